@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// End-to-end benchmark for ./parent + ./b.
+//
+//   ./bench gen [options] <file>         write a synthetic input file
+//   ./bench run [-r runs] <file> [parent args...]
+//   ./bench baseline                      generate baseline.txt and run it
+//
+// gen options:
+//   -n lines       number of lines (default 1000000)
+//   -t tokens      tokens per line (default 16)
+//   -w digits      maximum number width, 1..9 (default 9)
+//   -i fraction    fraction of lines with one invalid token (default 0)
+//   -o fraction    fraction of lines with one overflowing token (default 0)
+//   -s seed        RNG seed (default 1)
+//
+// "baseline" always uses the parameters below and checks baseline.txt against
+// BASELINE_CHECKSUM (md5sum shows 093acc4f84f56ae944dbf6ba9993be8b), so numbers
+// from different checkouts are measured on the same bytes. A file that is
+// missing or differs, say from an older generator, is generated again.
+//
+// The child stops at the first bad token, so non-zero -i/-o mostly measure how
+// fast the pipeline shuts down.
+
+#define BASELINE_FILE "baseline.txt"
+#define BASELINE_LINES 1000000
+#define BASELINE_TOKENS 16
+#define BASELINE_WIDTH 9
+#define BASELINE_SEED 20240101
+// 64-bit FNV-1a of the file these parameters produce.
+#define BASELINE_CHECKSUM 0x8b6bded945248145ULL
+
+typedef struct {
+    long lines;
+    int tokens;
+    int width;
+    double invalid;
+    double overflow;
+    unsigned int seed;
+} Gen_params;
+
+// xorshift64: same stream on every libc, so the baseline file is reproducible.
+static unsigned long long rng_state;
+
+static unsigned long long rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double rng_unit(void)
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int generate(const char *path, const Gen_params *g)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        return -1;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    rng_state = g->seed * 2654435761ULL + 1;
+
+    char token[32];
+    for (long i = 0; i < g->lines; i++) {
+        int bad = -1;
+        int bad_kind = 0;
+        double roll = rng_unit();
+        if (roll < g->invalid) {
+            bad_kind = 1;
+        } else if (roll < g->invalid + g->overflow) {
+            bad_kind = 2;
+        }
+        if (bad_kind) {
+            bad = rng_next() % g->tokens;
+        }
+
+        for (int t = 0; t < g->tokens; t++) {
+            int len = 0;
+            if (t == bad && bad_kind == 1) {
+                len = snprintf(token, sizeof(token), "%llux", rng_next() % 1000);
+            } else if (t == bad && bad_kind == 2) {
+                len = snprintf(token, sizeof(token), "%llu", 3000000000ULL + rng_next() % 1000000000ULL);
+            } else {
+                int digits = 1 + rng_next() % g->width;
+                if (rng_next() % 4 == 0) token[len++] = '-';
+                token[len++] = '1' + rng_next() % 9;
+                for (int d = 1; d < digits; d++) {
+                    token[len++] = '0' + rng_next() % 10;
+                }
+            }
+            token[len++] = t + 1 < g->tokens ? ' ' : '\n';
+            fwrite(token, 1, len, out);
+        }
+    }
+
+    return fclose(out);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long count_lines(const char *path)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return -1;
+    }
+    char buf[1 << 16];
+    long lines = 0;
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        for (char *p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++) {
+            lines++;
+        }
+    }
+    fclose(in);
+    return lines;
+}
+
+// 64-bit FNV-1a of the file's bytes; 0 if it cannot be read.
+static unsigned long long file_checksum(const char *path)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return 0;
+    }
+    unsigned char buf[1 << 16];
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            hash = (hash ^ buf[i]) * 0x100000001b3ULL;
+        }
+    }
+    int failed = ferror(in);
+    fclose(in);
+    return failed ? 0 : hash;
+}
+
+// Runs ./parent once with stdout and stderr sent to /dev/null. Wall time comes
+// from CLOCK_MONOTONIC, context switches from getrusage over all descendants.
+static int run_once(char **parent_argv, double *seconds, long *vcsw, long *ivcsw)
+{
+    struct rusage before, after;
+    getrusage(RUSAGE_CHILDREN, &before);
+
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        execv("./parent", parent_argv);
+        _exit(127);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    *seconds = now_seconds() - start;
+    getrusage(RUSAGE_CHILDREN, &after);
+
+    *vcsw = after.ru_nvcsw - before.ru_nvcsw;
+    *ivcsw = after.ru_nivcsw - before.ru_nivcsw;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static int run(const char *path, int runs, int extra_argc, char **extra_argv)
+{
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        perror(path);
+        return 1;
+    }
+    long lines = count_lines(path);
+
+    char *parent_argv[64];
+    int argc = 0;
+    parent_argv[argc++] = "./parent";
+    for (int i = 0; i < extra_argc && argc < 62; i++) {
+        parent_argv[argc++] = extra_argv[i];
+    }
+    parent_argv[argc++] = (char *)path;
+    parent_argv[argc] = NULL;
+
+    printf("file: %s, %ld lines, %lld bytes\n", path, lines, (long long)st.st_size);
+    printf("%4s %10s %14s %12s %10s %10s\n", "run", "wall_s", "lines/s", "MB/s", "vol_csw", "invol_csw");
+
+    double best = 0;
+    for (int r = 0; r < runs; r++) {
+        double seconds;
+        long vcsw, ivcsw;
+        if (run_once(parent_argv, &seconds, &vcsw, &ivcsw) == -1) {
+            fprintf(stderr, "./parent failed; are ./parent and ./b built?\n");
+            return 1;
+        }
+        if (r == 0 || seconds < best) {
+            best = seconds;
+        }
+        printf("%4d %10.3f %14.0f %12.1f %10ld %10ld\n", r + 1, seconds, lines / seconds,
+               st.st_size / (1024.0 * 1024.0) / seconds, vcsw, ivcsw);
+    }
+    printf("best %9.3f %14.0f %12.1f\n", best, lines / best, st.st_size / (1024.0 * 1024.0) / best);
+    return 0;
+}
+
+static void usage(void)
+{
+    const char msg[] = "Usage: ./bench gen [-n lines] [-t tokens] [-w digits] [-i frac] [-o frac] [-s seed] <file>\n"
+                       "       ./bench run [-r runs] <file> [parent args...]\n"
+                       "       ./bench baseline\n";
+    write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage();
+    }
+
+    if (strcmp(argv[1], "baseline") == 0) {
+        Gen_params g = {BASELINE_LINES, BASELINE_TOKENS, BASELINE_WIDTH, 0, 0, BASELINE_SEED};
+        if (file_checksum(BASELINE_FILE) != BASELINE_CHECKSUM) {
+            if (generate(BASELINE_FILE, &g) != 0) {
+                return 1;
+            }
+            if (file_checksum(BASELINE_FILE) != BASELINE_CHECKSUM) {
+                fprintf(stderr, "%s does not match BASELINE_CHECKSUM; has the generator changed?\n",
+                        BASELINE_FILE);
+                return 1;
+            }
+        }
+        return run(BASELINE_FILE, 5, 0, NULL);
+    }
+
+    int gen = strcmp(argv[1], "gen") == 0;
+    if (!gen && strcmp(argv[1], "run") != 0) {
+        usage();
+    }
+
+    Gen_params g = {1000000, 16, 9, 0, 0, 1};
+    int runs = 3;
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, gen ? "+n:t:w:i:o:s:" : "+r:")) != -1) {
+        switch (opt) {
+            case 'n': g.lines = atol(optarg); break;
+            case 't': g.tokens = atoi(optarg); break;
+            case 'w': g.width = atoi(optarg); break;
+            case 'i': g.invalid = atof(optarg); break;
+            case 'o': g.overflow = atof(optarg); break;
+            case 's': g.seed = strtoul(optarg, NULL, 10); break;
+            case 'r': runs = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if (optind >= argc) {
+        usage();
+    }
+
+    if (gen) {
+        if (g.lines < 0 || g.tokens < 1 || g.width < 1 || g.width > 9) {
+            usage();
+        }
+        return generate(argv[optind], &g) == 0 ? 0 : 1;
+    }
+    return run(argv[optind], runs > 0 ? runs : 1, argc - optind - 1, argv + optind + 1);
+}
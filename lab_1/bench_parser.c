@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "parser.h"
+
+// Microbenchmark: the original fgets/strtok/str_to_int loop of child.c against
+// the single-pass parser from parser.h, on the same in-memory input.
+//
+// Usage: ./bench_parser [lines] [tokens_per_line] [max_digits] [seed]
+
+#define BLOCK (64 * 1024)
+
+typedef struct {
+    size_t lines;
+    unsigned long long checksum;
+    int failed;
+} Result;
+
+static int legacy_is_valid_int(const char* str) {
+    if (*str == '\0') return 0;
+
+    for (const char* p = str; *p; p++) {
+        if (!isdigit(*p) && *p != '-' && *p != '+') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static enum status legacy_str_to_int(const char *str, int * result)
+{
+    if (!(legacy_is_valid_int(str))){
+        return INPUT_ERROR;
+    }
+    size_t len = strlen(str);
+    if (len > 11 || (len == 11 && str[0] == '-' && str[1] > '2') || (len == 10 && str[0] != '-')) {
+        return OVERFLOW;
+    }
+    char *endptr;
+    int temp;
+    temp = strtol(str, &endptr, 10);
+
+    if (*endptr != '\0') {
+        return INPUT_ERROR;
+    }
+    *result = (int)temp;
+    return SUCCESS;
+}
+
+static Result run_legacy(char *data, size_t size)
+{
+    Result r = {0};
+    FILE *in = fmemopen(data, size, "r");
+    char line[256];
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        unsigned int sum = 0;
+        line[strcspn(line, "\n")] = '\0';
+        char *token = strtok(line, " ");
+        while (token != NULL) {
+            int res = 0;
+            if (legacy_str_to_int(token, &res) != SUCCESS) {
+                r.failed = 1;
+                fclose(in);
+                return r;
+            }
+            sum += (unsigned int)res;
+            token = strtok(NULL, " ");
+        }
+        r.checksum = r.checksum * 31 + sum;
+        r.lines++;
+    }
+
+    fclose(in);
+    return r;
+}
+
+static Result run_single_pass(const char *data, size_t size)
+{
+    Result r = {0};
+    Line_parser parser;
+    enum parse_event event;
+
+    parser_init(&parser);
+    for (size_t off = 0; off < size; off += BLOCK) {
+        size_t n = size - off < BLOCK ? size - off : BLOCK;
+        size_t pos = 0;
+        while (pos < n) {
+            pos += parser_feed(&parser, data + off + pos, n - pos, &event);
+            if (event == LINE_DONE) {
+                r.checksum = r.checksum * 31 + (unsigned int)parser_sum(&parser);
+                r.lines++;
+            } else if (event == TOKEN_ERROR) {
+                r.failed = 1;
+                return r;
+            }
+        }
+    }
+    if (parser_finish(&parser) == LINE_DONE) {
+        r.checksum = r.checksum * 31 + (unsigned int)parser_sum(&parser);
+        r.lines++;
+    }
+    return r;
+}
+
+static char *generate(size_t lines, int tokens, int max_digits, unsigned int seed, size_t *size)
+{
+    size_t cap = lines * (size_t)tokens * (max_digits + 2) + lines + 1;
+    char *data = malloc(cap);
+    size_t len = 0;
+
+    srand(seed);
+    for (size_t i = 0; i < lines; i++) {
+        for (int t = 0; t < tokens; t++) {
+            int digits = 1 + rand() % max_digits;
+            if (rand() % 4 == 0) data[len++] = '-';
+            data[len++] = '1' + rand() % 9;
+            for (int d = 1; d < digits; d++) {
+                data[len++] = '0' + rand() % 10;
+            }
+            data[len++] = t + 1 < tokens ? ' ' : '\n';
+        }
+    }
+    *size = len;
+    return data;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    size_t lines = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    int tokens = argc > 2 ? atoi(argv[2]) : 16;
+    int max_digits = argc > 3 ? atoi(argv[3]) : 9;
+    unsigned int seed = argc > 4 ? strtoul(argv[4], NULL, 10) : 1;
+
+    if (tokens < 1 || max_digits < 1 || max_digits > 9) {
+        fprintf(stderr, "tokens_per_line must be >= 1 and max_digits in 1..9\n");
+        return 1;
+    }
+
+    size_t size;
+    char *data = generate(lines, tokens, max_digits, seed, &size);
+    double mb = size / (1024.0 * 1024.0);
+
+    double t0 = now_seconds();
+    Result legacy = run_legacy(data, size);
+    double t1 = now_seconds();
+    Result fast = run_single_pass(data, size);
+    double t2 = now_seconds();
+
+    printf("input: %zu lines, %d tokens/line, up to %d digits, %.1f MB\n",
+           lines, tokens, max_digits, mb);
+    printf("str_to_int:  %.3f s, %8.1f MB/s, %zu lines\n", t1 - t0, mb / (t1 - t0), legacy.lines);
+    printf("single-pass: %.3f s, %8.1f MB/s, %zu lines\n", t2 - t1, mb / (t2 - t1), fast.lines);
+    printf("speedup: %.2fx\n", (t1 - t0) / (t2 - t1));
+
+    // fgets splits lines over 255 bytes, so only shorter lines are comparable.
+    if (legacy.failed || fast.failed || legacy.lines != fast.lines || legacy.checksum != fast.checksum) {
+        printf("results differ%s\n",
+               (size_t)tokens * (max_digits + 2) > 255 ? " (lines longer than 255 bytes)" : "");
+        free(data);
+        return 1;
+    }
+
+    free(data);
+    return 0;
+}
@@ -1,80 +1,97 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <ctype.h>
-#include "string.h"
+#include <errno.h>
+#include "parser.h"
 
-enum status{
-    SUCCESS,
-    INPUT_ERROR,
-    OVERFLOW
-};
+#define READ_BLOCK (64 * 1024)
+#define OUT_BLOCK (64 * 1024)
+// Longest line write_sum can produce: "Sum: -2147483648\n".
+#define OUT_LINE_MAX 32
 
-int is_valid_int(const char* str) {
-    if (*str == '\0') return 0;
+// Results are collected here and written out a block at a time instead of one
+// write() per input line. Error messages go through the same buffer, so their
+// position relative to the sums is unchanged.
+static char out_buf[OUT_BLOCK];
+static size_t out_len = 0;
 
-    for (const char* p = str; *p; p++) {
-        if (!isdigit(*p) && *p != '-' && *p != '+') {
-            return 0;
+void flush_output(void) {
+    size_t done = 0;
+    while (done < out_len) {
+        ssize_t n = write(STDOUT_FILENO, out_buf + done, out_len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
         }
+        done += n;
     }
-    return 1;
+    out_len = 0;
 }
 
-enum status str_to_int(const char *str, int * result)
-{
-    if (!(is_valid_int(str))){
-        return INPUT_ERROR;
+void append_output(const char *data, size_t len) {
+    if (out_len + len > OUT_BLOCK) {
+        flush_output();
     }
-    size_t len = strlen(str);
-    if (len > 11 || (len == 11 && str[0] == '-' && str[1] > '2') || (len == 10 && str[0] != '-')) {
-        return OVERFLOW;
-    }
-    char *endptr;
-    int temp;
-    temp = strtol(str, &endptr, 10);
+    memcpy(out_buf + out_len, data, len);
+    out_len += len;
+}
 
-    if (*endptr != '\0') {
-        return INPUT_ERROR;
+void write_sum(int sum) {
+    if (out_len + OUT_LINE_MAX > OUT_BLOCK) {
+        flush_output();
     }
-    *result = (int)temp;
-    return SUCCESS;
+    char *p = out_buf + out_len;
+    memcpy(p, "Sum: ", 5);
+    p = format_int(p + 5, sum);
+    *p++ = '\n';
+    out_len = p - out_buf;
 }
 
-void write_sum(int sum) {
-    char msg[256];
-    int len = snprintf(msg, sizeof(msg), "Sum: %d\n", sum);
-    write(STDOUT_FILENO, msg, len);
+int report_error(enum status f) {
+    if (f == OVERFLOW) {
+        char msg[] = "Overflow\n";
+        append_output(msg, sizeof(msg));
+        flush_output();
+        return -1;
+    }
+    char msg[] = "Data is incorrect\n";
+    append_output(msg, sizeof(msg));
+    flush_output();
+    return -2;
 }
 
 int main() {
-    char line[256];
+    static char block[READ_BLOCK];
+    Line_parser parser;
+    enum parse_event event;
+    ssize_t n;
 
-    while (fgets(line, sizeof(line), stdin) != NULL) {
-        int sum = 0;
-        line[strcspn(line, "\n")] = '\0';
-        char *token = strtok(line, " ");
-        while (token != NULL) {
-            int res = 0;
-            enum status f = str_to_int(token, &res);
+    parser_init(&parser);
 
-            if (f == OVERFLOW) {
-                char msg[] = "Overflow\n";
-                write(STDOUT_FILENO, msg, sizeof(msg));
-                return -1;
-            } else if (f == INPUT_ERROR) {
-                char msg[] = "Data is incorrect\n";
-                write(STDOUT_FILENO, msg, sizeof(msg));
-                return -2;
-            } else {
-                sum += res;
-            }
+    while ((n = read(STDIN_FILENO, block, sizeof(block))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
 
-            token = strtok(NULL, " ");
+        size_t pos = 0;
+        while (pos < (size_t)n) {
+            pos += parser_feed(&parser, block + pos, n - pos, &event);
+            if (event == LINE_DONE) {
+                write_sum(parser_sum(&parser));
+            } else if (event == TOKEN_ERROR) {
+                return report_error(parser.error);
+            }
         }
+    }
 
-        write_sum(sum);
+    event = parser_finish(&parser);
+    if (event == LINE_DONE) {
+        write_sum(parser_sum(&parser));
+    } else if (event == TOKEN_ERROR) {
+        return report_error(parser.error);
     }
 
+    flush_output();
     return 0;
-}
\ No newline at end of file
+}
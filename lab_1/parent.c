@@ -1,28 +1,444 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
+#define CHUNK_SIZE (1 << 20)
+#define BUF_ALIGN 4096
+#define SCAN_SIZE 4096
+#define MAX_WORKERS 256
+// Output a shard may buffer while it waits for its turn. A shard that has
+// this much is not read until it is at the head, so its ./b blocks on the
+// full pipe; -j N needs at most (N - 1) * PENDING_MAX bytes of buffers.
+#define PENDING_MAX (16 * CHUNK_SIZE)
+
+typedef struct {
+    size_t bytes;
+    size_t syscalls;
+    int used_splice;
+} Stream_stats;
+
 void error(const char* msg)
 {
     write(STDERR_FILENO, msg, strlen(msg));
 }
 
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const char *buf, size_t len, Stream_stats *stats)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        stats->syscalls++;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        stats->bytes += n;
+    }
+    return 0;
+}
+
+// Fallback path: large page-aligned reads and writes. A negative offset means
+// "read sequentially until EOF" (pipes, FIFOs).
+static int copy_range(int in_fd, int out_fd, off_t offset, size_t length, Stream_stats *stats)
+{
+    char *buf;
+    if (posix_memalign((void **)&buf, BUF_ALIGN, CHUNK_SIZE) != 0) {
+        return -1;
+    }
+
+    int rc = 0;
+    while (length > 0) {
+        size_t chunk = length < CHUNK_SIZE ? length : CHUNK_SIZE;
+        ssize_t n = offset < 0 ? read(in_fd, buf, chunk) : pread(in_fd, buf, chunk, offset);
+        stats->syscalls++;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            rc = -1;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (write_all(out_fd, buf, n, stats) == -1) {
+            rc = -1;
+            break;
+        }
+        if (offset >= 0) offset += n;
+        length -= n;
+    }
+
+    free(buf);
+    return rc;
+}
+
+// Moves [offset, offset + length) of in_fd into the pipe out_fd. splice() keeps
+// the data in the page cache; if the kernel or the file type refuses it, the
+// remainder goes through copy_range().
+static int stream_range(int in_fd, int out_fd, off_t offset, size_t length, Stream_stats *stats)
+{
+    stats->used_splice = 1;
+    while (length > 0) {
+        size_t chunk = length < CHUNK_SIZE ? length : CHUNK_SIZE;
+        ssize_t n = splice(in_fd, offset < 0 ? NULL : &offset, out_fd, NULL, chunk,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+        stats->syscalls++;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL || errno == ENOSYS) {
+                stats->used_splice = 0;
+                return copy_range(in_fd, out_fd, offset, length, stats);
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        stats->bytes += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// The original per-line path, kept for comparison (-l).
+static int stream_lines(int in_fd, int out_fd, Stream_stats *stats)
+{
+    FILE *file = fdopen(in_fd, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    char line[256];
+    int rc = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (write_all(out_fd, line, strlen(line), stats) == -1) {
+            rc = -1;
+            break;
+        }
+    }
+    if (rc == 0 && ferror(file)) {
+        rc = -1;
+    }
+    int saved_errno = errno;
+    fclose(file);
+    errno = saved_errno;
+    return rc;
+}
+
+// A stream that ended in EPIPE only means the child stopped reading, which it
+// does on the first bad token; that is its own error to report, not ours.
+static int stream_failed(int rc)
+{
+    return rc == -1 && errno != EPIPE;
+}
+
+// Shard boundaries for -j: roughly equal byte ranges, each moved forward to just
+// past the next '\n' so that no line is split between two workers.
+static void split_at_lines(int fd, off_t size, int workers, off_t *bounds)
+{
+    char buf[SCAN_SIZE];
+
+    bounds[0] = 0;
+    for (int i = 1; i < workers; i++) {
+        off_t pos = size / workers * i;
+        if (pos < bounds[i - 1]) {
+            pos = bounds[i - 1];
+        }
+
+        off_t found = size;
+        while (pos < size) {
+            ssize_t n = pread(fd, buf, sizeof(buf), pos);
+            if (n <= 0) {
+                break;
+            }
+            char *nl = memchr(buf, '\n', n);
+            if (nl != NULL) {
+                found = pos + (nl - buf) + 1;
+                break;
+            }
+            pos += n;
+        }
+        bounds[i] = found;
+    }
+    bounds[workers] = size;
+}
+
+typedef struct {
+    pid_t worker;
+    pid_t feeder;
+    int out_fd;
+    int done;
+    char *pending;
+    size_t pending_len;
+    size_t pending_cap;
+} Shard;
+
+static void append_pending(Shard *shard, const char *data, size_t len)
+{
+    if (shard->pending_len + len > shard->pending_cap) {
+        size_t cap = shard->pending_cap ? shard->pending_cap : CHUNK_SIZE;
+        while (cap < shard->pending_len + len) {
+            cap *= 2;
+        }
+        shard->pending = realloc(shard->pending, cap);
+        shard->pending_cap = cap;
+    }
+    memcpy(shard->pending + shard->pending_len, data, len);
+    shard->pending_len += len;
+}
+
+// Undoes a start that failed partway: closes every pipe opened so far and
+// kills and reaps the processes already forked.
+static void abort_shards(int in_pipes[][2], int out_pipes[][2], Shard *shards, int workers)
+{
+    for (int i = 0; i < workers; i++) {
+        for (int end = 0; end < 2; end++) {
+            if (in_pipes[i][end] != -1) close(in_pipes[i][end]);
+            if (out_pipes[i][end] != -1) close(out_pipes[i][end]);
+        }
+        if (shards[i].worker > 0) kill(shards[i].worker, SIGKILL);
+        if (shards[i].feeder > 0) kill(shards[i].feeder, SIGKILL);
+    }
+    for (int i = 0; i < workers; i++) {
+        if (shards[i].worker > 0) waitpid(shards[i].worker, NULL, 0);
+        if (shards[i].feeder > 0) waitpid(shards[i].feeder, NULL, 0);
+    }
+}
+
+// -j N: every shard gets its own feeder process and its own ./b. Output of the
+// shard currently at the head is passed straight through, later shards are
+// buffered until their turn, up to PENDING_MAX each. A worker that failed
+// ends the output there, just like the single child stops on the first bad
+// token. Returns -1, with the error printed, if the shards could not be
+// started or a feeder failed.
+static int run_sharded(int fd, off_t size, int workers, Stream_stats *total)
+{
+    off_t bounds[MAX_WORKERS + 1];
+    int in_pipes[MAX_WORKERS][2];
+    int out_pipes[MAX_WORKERS][2];
+    Shard shards[MAX_WORKERS];
+    Stream_stats out_stats = {0};
+
+    split_at_lines(fd, size, workers, bounds);
+    memset(shards, 0, sizeof(shards));
+    memset(in_pipes, -1, sizeof(in_pipes));
+    memset(out_pipes, -1, sizeof(out_pipes));
+
+    for (int i = 0; i < workers; i++) {
+        if (pipe2(in_pipes[i], O_CLOEXEC) == -1 || pipe2(out_pipes[i], O_CLOEXEC) == -1) {
+            error("Pipe failed");
+            abort_shards(in_pipes, out_pipes, shards, workers);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            error("Fork failed");
+            abort_shards(in_pipes, out_pipes, shards, workers);
+            return -1;
+        }
+        if (pid == 0) {
+            dup2(in_pipes[i][0], STDIN_FILENO);
+            dup2(out_pipes[i][1], STDOUT_FILENO);
+            execv("./b", (char *[]){"./b", NULL});
+            error("execlp failed");
+            exit(EXIT_FAILURE);
+        }
+        shards[i].worker = pid;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            error("Fork failed");
+            abort_shards(in_pipes, out_pipes, shards, workers);
+            return -1;
+        }
+        if (pid == 0) {
+            for (int j = 0; j < workers; j++) {
+                close(in_pipes[j][0]);
+                close(out_pipes[j][0]);
+                close(out_pipes[j][1]);
+                if (j != i) close(in_pipes[j][1]);
+            }
+            Stream_stats stats = {0};
+            int rc = stream_range(fd, in_pipes[i][1], bounds[i], bounds[i + 1] - bounds[i], &stats);
+            _exit(stream_failed(rc) ? EXIT_FAILURE : 0);
+        }
+        shards[i].feeder = pid;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        close(in_pipes[i][0]);
+        close(in_pipes[i][1]);
+        close(out_pipes[i][1]);
+        shards[i].out_fd = out_pipes[i][0];
+        total->bytes += bounds[i + 1] - bounds[i];
+    }
+
+    static char buf[CHUNK_SIZE];
+    struct pollfd fds[MAX_WORKERS];
+    int head = 0;
+    int stopped = 0;
+
+    while (head < workers && !stopped) {
+        int nfds = 0;
+        int index[MAX_WORKERS];
+        for (int i = head; i < workers; i++) {
+            if (!shards[i].done && (i == head || shards[i].pending_len < PENDING_MAX)) {
+                fds[nfds].fd = shards[i].out_fd;
+                fds[nfds].events = POLLIN;
+                index[nfds++] = i;
+            }
+        }
+
+        if (nfds > 0 && poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int k = 0; k < nfds; k++) {
+            if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            Shard *shard = &shards[index[k]];
+            ssize_t n = read(shard->out_fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                shard->done = 1;
+                close(shard->out_fd);
+            } else if (index[k] == head) {
+                write_all(STDOUT_FILENO, buf, n, &out_stats);
+            } else {
+                append_pending(shard, buf, n);
+            }
+        }
+
+        while (head < workers && shards[head].done) {
+            int status;
+            waitpid(shards[head].worker, &status, 0);
+            shards[head].worker = 0;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                stopped = 1;
+                break;
+            }
+            head++;
+            if (head < workers) {
+                write_all(STDOUT_FILENO, shards[head].pending, shards[head].pending_len, &out_stats);
+                free(shards[head].pending);
+                shards[head].pending = NULL;
+                shards[head].pending_len = 0;
+                shards[head].pending_cap = 0;
+            }
+        }
+    }
+
+    int rc = 0;
+    for (int i = 0; i < workers; i++) {
+        if (!shards[i].done) {
+            close(shards[i].out_fd);
+        }
+        if (shards[i].worker > 0) {
+            waitpid(shards[i].worker, NULL, 0);
+        }
+        int status;
+        if (waitpid(shards[i].feeder, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            rc = -1;
+        }
+        free(shards[i].pending);
+    }
+
+    if (rc == -1) {
+        error("Error streaming input\n");
+    }
+    return rc;
+}
+
+static void report(const Stream_stats *stats, const char *mode, double seconds)
+{
+    char msg[256];
+    double mb = stats->bytes / (1024.0 * 1024.0);
+    int len = snprintf(msg, sizeof(msg),
+                       "Streamed %zu bytes in %.3f s: %.1f MB/s, %zu syscalls (%s)\n",
+                       stats->bytes, seconds, seconds > 0 ? mb / seconds : 0.0,
+                       stats->syscalls, mode);
+    write(STDERR_FILENO, msg, len);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        const char msg[] = "Usage: %s <filename>\n";
-        write(STDERR_FILENO, msg, sizeof(msg));
+    int line_mode = 0;
+    int workers = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "lj:")) != -1) {
+        if (opt == 'l') {
+            line_mode = 1;
+        } else if (opt == 'j' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_WORKERS) {
+            workers = atoi(optarg);
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+
+    if (optind != argc - 1 || (line_mode && workers > 1)) {
+        const char msg[] = "Usage: ./parent [-l | -j N] <filename>\n";
+        write(STDERR_FILENO, msg, sizeof(msg) - 1);
         exit(EXIT_FAILURE);
     }
 
-    FILE *file = fopen(argv[1], "r");
-    if (file == NULL) {
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd == -1) {
         error("Error opening file");
         exit(EXIT_FAILURE);
     }
 
+    // The child stops reading on the first bad token; that must not kill us.
+    signal(SIGPIPE, SIG_IGN);
+
+    if (workers > 1) {
+        struct stat st;
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            error("-j needs a regular file\n");
+            exit(EXIT_FAILURE);
+        }
+
+        Stream_stats stats = {0};
+        double start = now_seconds();
+        int rc = run_sharded(fd, st.st_size, workers, &stats);
+        close(fd);
+        if (rc == -1) {
+            exit(EXIT_FAILURE);
+        }
+
+        double seconds = now_seconds() - start;
+        char msg[256];
+        int len = snprintf(msg, sizeof(msg), "Streamed %zu bytes to %d workers in %.3f s: %.1f MB/s\n",
+                           stats.bytes, workers, seconds,
+                           seconds > 0 ? stats.bytes / (1024.0 * 1024.0) / seconds : 0.0);
+        write(STDERR_FILENO, msg, len);
+        return 0;
+    }
+
     int chanel[2];
     if (pipe(chanel) == -1) {
         error("Pipe failed");
@@ -38,24 +454,46 @@ int main(int argc, char *argv[]) {
     if (pid == 0) {
 
         close(chanel[1]);
+        close(fd);
 
         dup2(chanel[0], STDIN_FILENO);
         close(chanel[0]);
 
-        execv("./b","./b", NULL);
+        execv("./b", (char *[]){"./b", NULL});
         error("execlp failed");
         exit(EXIT_FAILURE);
     } else {
         close(chanel[0]);
 
-        char line[256];
-        while (fgets(line, sizeof(line), file) != NULL) {
-            write(chanel[1], line, strlen(line));
+        Stream_stats stats = {0};
+        const char *mode;
+        double start = now_seconds();
+        int rc;
+
+        if (line_mode) {
+            rc = stream_lines(fd, chanel[1], &stats);
+            mode = "line";
+        } else {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+                rc = stream_range(fd, chanel[1], 0, st.st_size, &stats);
+            } else {
+                rc = stream_range(fd, chanel[1], -1, (size_t)-1, &stats);
+            }
+            mode = stats.used_splice ? "splice" : "buffered";
+            close(fd);
         }
+        int failed = stream_failed(rc);
         close(chanel[1]);
-        fclose(file);
+        // Only the streaming is timed, not the child parsing what is left.
+        double seconds = now_seconds() - start;
 
         wait(NULL);
+        if (failed) {
+            error("Error streaming input\n");
+            exit(EXIT_FAILURE);
+        }
+        report(&stats, mode, seconds);
     }
 
     return 0;
@@ -0,0 +1,188 @@
+#ifndef LAB_1_PARSER_H
+#define LAB_1_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+enum status{
+    SUCCESS,
+    INPUT_ERROR,
+    OVERFLOW
+};
+
+enum parse_event {
+    NEED_MORE,
+    LINE_DONE,
+    TOKEN_ERROR
+};
+
+// Magnitude of INT_MIN; anything above it cannot be an int in either sign.
+#define INT_MAGNITUDE_LIMIT 2147483648ULL
+
+// Streaming state for one line: tokens are [+-]?[0-9]+ separated by spaces,
+// lines end at '\n'. Every byte is looked at once, blocks may split anywhere.
+typedef struct {
+    unsigned int sum;
+    uint64_t value;
+    int in_token;
+    int negative;
+    int digits;
+    int malformed;
+    int line_has_bytes;
+    enum status error;
+} Line_parser;
+
+static inline void parser_init(Line_parser *p)
+{
+    memset(p, 0, sizeof(*p));
+}
+
+static inline int parser_sum(const Line_parser *p)
+{
+    return (int)p->sum;
+}
+
+// 1 if all eight bytes of x are ASCII digits.
+static inline int all_digits8(uint64_t x)
+{
+    return (x & 0xF0F0F0F0F0F0F0F0ULL) == 0x3030303030303030ULL &&
+           ((x + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) == 0x3030303030303030ULL;
+}
+
+// Value of eight ASCII digits, first digit in the lowest byte.
+static inline uint32_t parse_digits8(uint64_t x)
+{
+    x -= 0x3030303030303030ULL;
+    x = (x * 10) + (x >> 8);
+    x = (((x & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+         (((x >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    return (uint32_t)x;
+}
+
+static inline void parser_add_digits(Line_parser *p, uint64_t value, uint64_t scale, int count)
+{
+    p->value = p->value * scale + value;
+    if (p->value > INT_MAGNITUDE_LIMIT) {
+        p->value = INT_MAGNITUDE_LIMIT + 1;
+    }
+    p->digits += count;
+}
+
+static inline int parser_end_token(Line_parser *p)
+{
+    p->in_token = 0;
+    if (p->malformed || p->digits == 0) {
+        p->error = INPUT_ERROR;
+        return 0;
+    }
+    if (p->value > INT_MAGNITUDE_LIMIT || (!p->negative && p->value == INT_MAGNITUDE_LIMIT)) {
+        p->error = OVERFLOW;
+        return 0;
+    }
+    uint32_t v = (uint32_t)p->value;
+    p->sum += p->negative ? -v : v;
+    return 1;
+}
+
+// Consumes bytes from buf until a line ends, a token is rejected or the block
+// runs out. Returns the number of bytes consumed and reports why in *event.
+static inline size_t parser_feed(Line_parser *p, const char *buf, size_t len, enum parse_event *event)
+{
+    size_t i = 0;
+
+    if (!p->in_token && !p->line_has_bytes) {
+        p->sum = 0;
+    }
+
+    while (i < len) {
+        if (p->in_token && !p->malformed) {
+            uint64_t word;
+            while (len - i >= 8) {
+                memcpy(&word, buf + i, 8);
+                if (!all_digits8(word)) {
+                    break;
+                }
+                parser_add_digits(p, parse_digits8(word), 100000000ULL, 8);
+                i += 8;
+            }
+            if (i == len) {
+                break;
+            }
+        }
+
+        unsigned char c = (unsigned char)buf[i++];
+        p->line_has_bytes = 1;
+
+        if (c >= '0' && c <= '9') {
+            if (!p->in_token) {
+                p->in_token = 1;
+                p->negative = 0;
+                p->value = 0;
+                p->digits = 0;
+                p->malformed = 0;
+            }
+            parser_add_digits(p, c - '0', 10, 1);
+        } else if (c == ' ' || c == '\n') {
+            if (p->in_token && !parser_end_token(p)) {
+                *event = TOKEN_ERROR;
+                return i;
+            }
+            if (c == '\n') {
+                p->line_has_bytes = 0;
+                *event = LINE_DONE;
+                return i;
+            }
+        } else if (!p->in_token && (c == '-' || c == '+')) {
+            p->in_token = 1;
+            p->negative = c == '-';
+            p->value = 0;
+            p->digits = 0;
+            p->malformed = 0;
+        } else {
+            if (!p->in_token) {
+                p->in_token = 1;
+                p->digits = 0;
+            }
+            p->malformed = 1;
+        }
+    }
+
+    *event = NEED_MORE;
+    return i;
+}
+
+// Called at end of input: a last line without '\n' still counts.
+static inline enum parse_event parser_finish(Line_parser *p)
+{
+    if (p->in_token && !parser_end_token(p)) {
+        return TOKEN_ERROR;
+    }
+    if (p->line_has_bytes) {
+        p->line_has_bytes = 0;
+        return LINE_DONE;
+    }
+    return NEED_MORE;
+}
+
+// Writes the decimal form of value at p and returns the end. Used by the
+// children of lab_1 and lab_3 to print sums without going through printf.
+static inline char *format_int(char *p, int value)
+{
+    char digits[10];
+    unsigned int v = value < 0 ? -(unsigned int)value : (unsigned int)value;
+    int n = 0;
+    if (value < 0) {
+        *p++ = '-';
+    }
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+#endif
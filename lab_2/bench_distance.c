@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "distance.h"
+
+// Microbenchmark: the original sqrt(pow(dx, 2) + pow(dy, 2)) loop over an
+// array of Point structs against every nearest-centroid kernel from
+// distance.h that this CPU supports, on the same random data. Reports point x
+// centroid distance evaluations per second and checks that every kernel picks
+// the same centroid for every point as the original loop, which only fails
+// on near-ties the original's sqrt rounds together (see distance.h).
+//
+// Usage: ./bench_distance [points] [clusters] [rounds] [seed]
+
+typedef struct {
+    double x, y;
+} Point;
+
+static void nearest_legacy(const Point* points, int count, const Point* centroids,
+                           int num_clusters, int* nearest)
+{
+    for (int i = 0; i < count; i++) {
+        double min_dist = INFINITY;
+        int closest_cluster = -1;
+        for (int j = 0; j < num_clusters; j++) {
+            double dist = sqrt(pow(points[i].x - centroids[j].x, 2) +
+                               pow(points[i].y - centroids[j].y, 2));
+            if (dist < min_dist) {
+                min_dist = dist;
+                closest_cluster = j;
+            }
+        }
+        nearest[i] = closest_cluster;
+    }
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, double seconds, double evals, int same)
+{
+    printf("%-8s %8.3f s %10.1f M evals/s%s\n", name, seconds, evals / seconds / 1e6,
+           same ? "" : "  ASSIGNMENTS DIFFER");
+}
+
+int main(int argc, char *argv[]) {
+    int num_points = argc > 1 ? atoi(argv[1]) : 100000;
+    int num_clusters = argc > 2 ? atoi(argv[2]) : 100;
+    int rounds = argc > 3 ? atoi(argv[3]) : 10;
+    unsigned int seed = argc > 4 ? strtoul(argv[4], NULL, 10) : 1;
+
+    if (num_points < 1 || num_clusters < 1 || rounds < 1) {
+        fprintf(stderr, "points, clusters and rounds must be >= 1\n");
+        return 1;
+    }
+
+    Point* points = malloc(num_points * sizeof(Point));
+    Point* centroids = malloc(num_clusters * sizeof(Point));
+    double* xs = malloc(num_points * sizeof(double));
+    double* ys = malloc(num_points * sizeof(double));
+    double* cx = malloc(num_clusters * sizeof(double));
+    double* cy = malloc(num_clusters * sizeof(double));
+    int* expected = malloc(num_points * sizeof(int));
+    int* nearest = malloc(num_points * sizeof(int));
+
+    srand(seed);
+    for (int i = 0; i < num_points; i++) {
+        points[i].x = xs[i] = rand() / (double)RAND_MAX * 200 - 100;
+        points[i].y = ys[i] = rand() / (double)RAND_MAX * 200 - 100;
+    }
+    for (int j = 0; j < num_clusters; j++) {
+        centroids[j].x = cx[j] = rand() / (double)RAND_MAX * 200 - 100;
+        centroids[j].y = cy[j] = rand() / (double)RAND_MAX * 200 - 100;
+    }
+
+    double evals = (double)num_points * num_clusters * rounds;
+    printf("%d points x %d clusters, %d rounds\n", num_points, num_clusters, rounds);
+
+    double t0 = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        nearest_legacy(points, num_points, centroids, num_clusters, expected);
+    }
+    double legacy = now_seconds() - t0;
+    report("sqrt/pow", legacy, evals, 1);
+
+    int failed = 0;
+    for (int k = 0; k < KERNEL_COUNT; k++) {
+        if (!kernel_supported(k)) {
+            printf("%-8s not supported by this CPU\n", kernel_names[k]);
+            continue;
+        }
+        memset(nearest, 0xff, num_points * sizeof(int));
+        t0 = now_seconds();
+        for (int r = 0; r < rounds; r++) {
+            kernel_functions[k](xs, ys, num_points, cx, cy, num_clusters, nearest);
+        }
+        double seconds = now_seconds() - t0;
+        int same = memcmp(nearest, expected, num_points * sizeof(int)) == 0;
+        failed |= !same;
+        report(kernel_names[k], seconds, evals, same);
+    }
+
+    free(points);
+    free(centroids);
+    free(xs);
+    free(ys);
+    free(cx);
+    free(cy);
+    free(expected);
+    free(nearest);
+    return failed;
+}
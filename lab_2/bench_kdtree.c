@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "distance.h"
+#include "kdtree.h"
+
+// Microbenchmark: nearest-centroid search for K = 100, 1000 and 10000 (or the
+// cluster counts given) with the widest kernel from distance.h against the
+// k-d tree from kdtree.h, on the same random data. The tree is timed three
+// ways: building it, searching with no hint, and searching with the answer
+// for slightly different centroids as the hint, which is what a k-means
+// iteration sees once the centroids have settled. Every search must pick the
+// same centroid for every point as the kernel.
+//
+// Usage: ./bench_kdtree [points] [rounds] [seed] [clusters...]
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double random_coordinate(void)
+{
+    return rand() / (double)RAND_MAX * 200 - 100;
+}
+
+int main(int argc, char *argv[]) {
+    int num_points = argc > 1 ? atoi(argv[1]) : 100000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 3;
+    unsigned int seed = argc > 3 ? strtoul(argv[3], NULL, 10) : 1;
+    int default_clusters[] = {100, 1000, 10000};
+    int* cluster_counts = argc > 4 ? malloc((argc - 4) * sizeof(int)) : default_clusters;
+    int num_counts = argc > 4 ? argc - 4 : 3;
+    for (int c = 0; c < num_counts && argc > 4; c++) {
+        cluster_counts[c] = atoi(argv[4 + c]);
+    }
+
+    int max_clusters = 0;
+    for (int c = 0; c < num_counts; c++) {
+        if (cluster_counts[c] < 1) {
+            fprintf(stderr, "clusters must be >= 1\n");
+            return 1;
+        }
+        if (cluster_counts[c] > max_clusters) {
+            max_clusters = cluster_counts[c];
+        }
+    }
+    if (num_points < 1 || rounds < 1) {
+        fprintf(stderr, "points and rounds must be >= 1\n");
+        return 1;
+    }
+
+    double* xs = malloc(num_points * sizeof(double));
+    double* ys = malloc(num_points * sizeof(double));
+    double* cx = malloc(max_clusters * sizeof(double));
+    double* cy = malloc(max_clusters * sizeof(double));
+    double* moved_x = malloc(max_clusters * sizeof(double));
+    double* moved_y = malloc(max_clusters * sizeof(double));
+    int* expected = malloc(num_points * sizeof(int));
+    int* nearest = malloc(num_points * sizeof(int));
+    int* hint = malloc(num_points * sizeof(int));
+    Kd_tree tree;
+    if (kd_alloc(&tree, max_clusters) != 0) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    srand(seed);
+    for (int i = 0; i < num_points; i++) {
+        xs[i] = random_coordinate();
+        ys[i] = random_coordinate();
+    }
+
+    enum kernel kernel = best_kernel();
+    Nearest_fn scan = kernel_functions[kernel];
+    printf("%d points, %d rounds, %s kernel; times are per round\n", num_points, rounds,
+           kernel_names[kernel]);
+    printf("%8s %10s %10s %10s %10s %10s %10s %9s\n", "clusters", "scan s", "build s",
+           "tree s", "speedup", "hinted s", "speedup", "dist/pt");
+
+    int failed = 0;
+    for (int c = 0; c < num_counts; c++) {
+        int num_clusters = cluster_counts[c];
+        for (int j = 0; j < num_clusters; j++) {
+            cx[j] = random_coordinate();
+            cy[j] = random_coordinate();
+            // The hint comes from centroids moved by up to half a percent of
+            // their typical spacing, 200 / sqrt(K), in each coordinate.
+            double step = 0.01 * 200 / sqrt(num_clusters);
+            moved_x[j] = cx[j] + (rand() / (double)RAND_MAX - 0.5) * step;
+            moved_y[j] = cy[j] + (rand() / (double)RAND_MAX - 0.5) * step;
+        }
+        scan(xs, ys, num_points, moved_x, moved_y, num_clusters, hint);
+
+        double t0 = now_seconds();
+        for (int r = 0; r < rounds; r++) {
+            scan(xs, ys, num_points, cx, cy, num_clusters, expected);
+        }
+        double scan_seconds = (now_seconds() - t0) / rounds;
+
+        t0 = now_seconds();
+        for (int r = 0; r < rounds; r++) {
+            kd_build(&tree, cx, cy, num_clusters);
+        }
+        double build_seconds = (now_seconds() - t0) / rounds;
+
+        memset(nearest, 0xff, num_points * sizeof(int));
+        t0 = now_seconds();
+        for (int r = 0; r < rounds; r++) {
+            kd_nearest(&tree, xs, ys, num_points, cx, cy, NULL, nearest);
+        }
+        double tree_seconds = (now_seconds() - t0) / rounds;
+        int same = memcmp(nearest, expected, num_points * sizeof(int)) == 0;
+
+        memset(nearest, 0xff, num_points * sizeof(int));
+        long distances = 0;
+        t0 = now_seconds();
+        for (int r = 0; r < rounds; r++) {
+            distances = kd_nearest(&tree, xs, ys, num_points, cx, cy, hint, nearest);
+        }
+        double hinted_seconds = (now_seconds() - t0) / rounds;
+        same &= memcmp(nearest, expected, num_points * sizeof(int)) == 0;
+        failed |= !same;
+
+        printf("%8d %10.4f %10.6f %10.4f %9.1fx %10.4f %9.1fx %9.1f%s\n", num_clusters,
+               scan_seconds, build_seconds, tree_seconds,
+               scan_seconds / (build_seconds + tree_seconds), hinted_seconds,
+               scan_seconds / (build_seconds + hinted_seconds), (double)distances / num_points,
+               same ? "" : "  ASSIGNMENTS DIFFER");
+    }
+
+    kd_free(&tree);
+    free(xs);
+    free(ys);
+    free(cx);
+    free(cy);
+    free(moved_x);
+    free(moved_y);
+    free(expected);
+    free(nearest);
+    free(hint);
+    if (cluster_counts != default_clusters) {
+        free(cluster_counts);
+    }
+    return failed;
+}
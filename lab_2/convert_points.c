@@ -0,0 +1,61 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "points.h"
+
+// Converts lab_2 point files between the text and binary formats of points.h.
+// The direction follows the input: text becomes binary, binary becomes text.
+// Text is written with %.17g, so text -> binary -> text -> binary gives back
+// the same binary file.
+//
+// Usage: ./convert_points <input> <output>
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: ./convert_points <input> <output>\n");
+        return 1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    Point_set set;
+    double t0 = now_seconds();
+    int status = points_load(argv[1], cpus > 0 ? cpus : 1, &set);
+    double t1 = now_seconds();
+    if (status == -1) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (status == -2) {
+        fprintf(stderr, "%s: malformed point %ld\n", argv[1], set.error_at);
+        return 1;
+    }
+    if (status == -3) {
+        fprintf(stderr, "%s: not enough memory\n", argv[1]);
+        return 1;
+    }
+
+    int to_binary = !set.binary;
+    status = to_binary ? points_write_binary(argv[2], set.xs, set.ys, set.count)
+                       : points_write_text(argv[2], set.xs, set.ys, set.count);
+    double t2 = now_seconds();
+    if (status != 0) {
+        perror(argv[2]);
+        points_free(&set);
+        return 1;
+    }
+
+    fprintf(stderr, "%ld points, %s -> %s: read %.3f s, write %.3f s\n", set.count,
+            to_binary ? "text" : "binary", to_binary ? "binary" : "text", t1 - t0, t2 - t1);
+    points_free(&set);
+    return 0;
+}
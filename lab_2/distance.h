@@ -0,0 +1,190 @@
+#ifndef LAB_2_DISTANCE_H
+#define LAB_2_DISTANCE_H
+
+#include <math.h>
+#include <string.h>
+#include <immintrin.h>
+
+// Nearest-centroid search over points and centroids stored as separate x and
+// y arrays. They compare squared distances instead of the original
+//
+//     dist = sqrt(pow(px - cx, 2) + pow(py - cy, 2)); if (dist < min_dist) ...
+//
+// loop. sqrt is monotonic but not injective on doubles: two different squared
+// distances can round to the same root, where the original keeps the lower
+// index and the kernels pick the strictly nearer centroid. Apart from such
+// near-ties the answer is the same. The centroids of each point are visited
+// in order with a strict "<", so exact ties go to the lowest index. The vector
+// kernels keep one point per lane and walk the centroids in that same order,
+// so all kernels agree with each other bit for bit. They work on two registers
+// of points at a time so the compare/select chains of the two overlap.
+//
+// The distance must be rounded as dx*dx + dy*dy with no fused multiply-add,
+// otherwise kernels could disagree in the last bit, so contraction is turned
+// off for the kernels below.
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+
+typedef void (*Nearest_fn)(const double* xs, const double* ys, int count,
+                           const double* cx, const double* cy, int num_clusters,
+                           int* nearest);
+
+enum kernel {
+    KERNEL_SCALAR,
+    KERNEL_SSE2,
+    KERNEL_AVX2,
+    KERNEL_AVX512,
+    KERNEL_COUNT
+};
+
+static const char* const kernel_names[KERNEL_COUNT] = {"scalar", "sse2", "avx2", "avx512"};
+
+static inline void nearest_scalar(const double* xs, const double* ys, int count,
+                                  const double* cx, const double* cy, int num_clusters,
+                                  int* nearest) {
+    for (int i = 0; i < count; i++) {
+        double min_dist = INFINITY;
+        int closest = -1;
+        for (int j = 0; j < num_clusters; j++) {
+            double dx = xs[i] - cx[j];
+            double dy = ys[i] - cy[j];
+            double dist = dx * dx + dy * dy;
+            if (dist < min_dist) {
+                min_dist = dist;
+                closest = j;
+            }
+        }
+        nearest[i] = closest;
+    }
+}
+
+static inline void nearest_sse2(const double* xs, const double* ys, int count,
+                                const double* cx, const double* cy, int num_clusters,
+                                int* nearest) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128d px0 = _mm_loadu_pd(xs + i), px1 = _mm_loadu_pd(xs + i + 2);
+        __m128d py0 = _mm_loadu_pd(ys + i), py1 = _mm_loadu_pd(ys + i + 2);
+        __m128d best0 = _mm_set1_pd(INFINITY), best1 = best0;
+        __m128d index0 = _mm_set1_pd(-1), index1 = index0;
+        for (int j = 0; j < num_clusters; j++) {
+            __m128d ccx = _mm_set1_pd(cx[j]);
+            __m128d ccy = _mm_set1_pd(cy[j]);
+            __m128d cj = _mm_set1_pd(j);
+            __m128d dx0 = _mm_sub_pd(px0, ccx), dx1 = _mm_sub_pd(px1, ccx);
+            __m128d dy0 = _mm_sub_pd(py0, ccy), dy1 = _mm_sub_pd(py1, ccy);
+            __m128d dist0 = _mm_add_pd(_mm_mul_pd(dx0, dx0), _mm_mul_pd(dy0, dy0));
+            __m128d dist1 = _mm_add_pd(_mm_mul_pd(dx1, dx1), _mm_mul_pd(dy1, dy1));
+            __m128d closer0 = _mm_cmplt_pd(dist0, best0);
+            __m128d closer1 = _mm_cmplt_pd(dist1, best1);
+            best0 = _mm_min_pd(dist0, best0);
+            best1 = _mm_min_pd(dist1, best1);
+            index0 = _mm_or_pd(_mm_and_pd(closer0, cj), _mm_andnot_pd(closer0, index0));
+            index1 = _mm_or_pd(_mm_and_pd(closer1, cj), _mm_andnot_pd(closer1, index1));
+        }
+        _mm_storel_epi64((__m128i*)(nearest + i), _mm_cvtpd_epi32(index0));
+        _mm_storel_epi64((__m128i*)(nearest + i + 2), _mm_cvtpd_epi32(index1));
+    }
+    nearest_scalar(xs + i, ys + i, count - i, cx, cy, num_clusters, nearest + i);
+}
+
+__attribute__((target("avx2")))
+static inline void nearest_avx2(const double* xs, const double* ys, int count,
+                                const double* cx, const double* cy, int num_clusters,
+                                int* nearest) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256d px0 = _mm256_loadu_pd(xs + i), px1 = _mm256_loadu_pd(xs + i + 4);
+        __m256d py0 = _mm256_loadu_pd(ys + i), py1 = _mm256_loadu_pd(ys + i + 4);
+        __m256d best0 = _mm256_set1_pd(INFINITY), best1 = best0;
+        __m256d index0 = _mm256_set1_pd(-1), index1 = index0;
+        for (int j = 0; j < num_clusters; j++) {
+            __m256d ccx = _mm256_broadcast_sd(cx + j);
+            __m256d ccy = _mm256_broadcast_sd(cy + j);
+            __m256d cj = _mm256_set1_pd(j);
+            __m256d dx0 = _mm256_sub_pd(px0, ccx), dx1 = _mm256_sub_pd(px1, ccx);
+            __m256d dy0 = _mm256_sub_pd(py0, ccy), dy1 = _mm256_sub_pd(py1, ccy);
+            __m256d dist0 = _mm256_add_pd(_mm256_mul_pd(dx0, dx0), _mm256_mul_pd(dy0, dy0));
+            __m256d dist1 = _mm256_add_pd(_mm256_mul_pd(dx1, dx1), _mm256_mul_pd(dy1, dy1));
+            __m256d closer0 = _mm256_cmp_pd(dist0, best0, _CMP_LT_OQ);
+            __m256d closer1 = _mm256_cmp_pd(dist1, best1, _CMP_LT_OQ);
+            best0 = _mm256_min_pd(dist0, best0);
+            best1 = _mm256_min_pd(dist1, best1);
+            index0 = _mm256_blendv_pd(index0, cj, closer0);
+            index1 = _mm256_blendv_pd(index1, cj, closer1);
+        }
+        _mm_storeu_si128((__m128i*)(nearest + i), _mm256_cvtpd_epi32(index0));
+        _mm_storeu_si128((__m128i*)(nearest + i + 4), _mm256_cvtpd_epi32(index1));
+    }
+    nearest_scalar(xs + i, ys + i, count - i, cx, cy, num_clusters, nearest + i);
+}
+
+__attribute__((target("avx512f")))
+static inline void nearest_avx512(const double* xs, const double* ys, int count,
+                                  const double* cx, const double* cy, int num_clusters,
+                                  int* nearest) {
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512d px0 = _mm512_loadu_pd(xs + i), px1 = _mm512_loadu_pd(xs + i + 8);
+        __m512d py0 = _mm512_loadu_pd(ys + i), py1 = _mm512_loadu_pd(ys + i + 8);
+        __m512d best0 = _mm512_set1_pd(INFINITY), best1 = best0;
+        __m512d index0 = _mm512_set1_pd(-1), index1 = index0;
+        for (int j = 0; j < num_clusters; j++) {
+            __m512d ccx = _mm512_set1_pd(cx[j]);
+            __m512d ccy = _mm512_set1_pd(cy[j]);
+            __m512d cj = _mm512_set1_pd(j);
+            __m512d dx0 = _mm512_sub_pd(px0, ccx), dx1 = _mm512_sub_pd(px1, ccx);
+            __m512d dy0 = _mm512_sub_pd(py0, ccy), dy1 = _mm512_sub_pd(py1, ccy);
+            __m512d dist0 = _mm512_add_pd(_mm512_mul_pd(dx0, dx0), _mm512_mul_pd(dy0, dy0));
+            __m512d dist1 = _mm512_add_pd(_mm512_mul_pd(dx1, dx1), _mm512_mul_pd(dy1, dy1));
+            __mmask8 closer0 = _mm512_cmp_pd_mask(dist0, best0, _CMP_LT_OQ);
+            __mmask8 closer1 = _mm512_cmp_pd_mask(dist1, best1, _CMP_LT_OQ);
+            best0 = _mm512_mask_mov_pd(best0, closer0, dist0);
+            best1 = _mm512_mask_mov_pd(best1, closer1, dist1);
+            index0 = _mm512_mask_mov_pd(index0, closer0, cj);
+            index1 = _mm512_mask_mov_pd(index1, closer1, cj);
+        }
+        _mm256_storeu_si256((__m256i*)(nearest + i), _mm512_cvtpd_epi32(index0));
+        _mm256_storeu_si256((__m256i*)(nearest + i + 8), _mm512_cvtpd_epi32(index1));
+    }
+    nearest_scalar(xs + i, ys + i, count - i, cx, cy, num_clusters, nearest + i);
+}
+
+#pragma GCC pop_options
+
+static const Nearest_fn kernel_functions[KERNEL_COUNT] = {
+    nearest_scalar, nearest_sse2, nearest_avx2, nearest_avx512
+};
+
+static inline int kernel_supported(enum kernel k) {
+    __builtin_cpu_init();
+    switch (k) {
+        case KERNEL_SCALAR: return 1;
+        case KERNEL_SSE2: return __builtin_cpu_supports("sse2");
+        case KERNEL_AVX2: return __builtin_cpu_supports("avx2");
+        case KERNEL_AVX512: return __builtin_cpu_supports("avx512f");
+        default: return 0;
+    }
+}
+
+// Widest kernel this CPU can run.
+static inline enum kernel best_kernel(void) {
+    for (int k = KERNEL_COUNT - 1; k > KERNEL_SCALAR; k--) {
+        if (kernel_supported(k)) {
+            return k;
+        }
+    }
+    return KERNEL_SCALAR;
+}
+
+// Returns the kernel called name, or -1.
+static inline int kernel_by_name(const char* name) {
+    for (int k = 0; k < KERNEL_COUNT; k++) {
+        if (strcmp(name, kernel_names[k]) == 0) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,221 @@
+#ifndef LAB_2_KDTREE_H
+#define LAB_2_KDTREE_H
+
+#include <math.h>
+#include <stdlib.h>
+
+// k-d tree over the centroids, so finding the nearest centroid of a point
+// takes about log K distance computations instead of K.
+//
+// The tree is implicit. The centroids are copied into x/y in tree order; a
+// range [lo, hi) of more than KD_LEAF centroids has its node in the middle
+// slot, mid, with the centroids on the low side of its splitting line in
+// [lo, mid) and the rest in [mid + 1, hi). axis[mid] is 0 if the node splits
+// on x and 1 if on y. Ranges of at most KD_LEAF centroids are leaves and are
+// scanned.
+//
+// The answer is exactly that of the kernels in distance.h: distances are
+// rounded as dx*dx + dy*dy with no fused multiply-add, equal distances go to
+// the lowest centroid number, and a subtree is skipped only when the squared
+// distance to its splitting line is strictly greater than the best distance.
+// Rounding is monotonic, so that value is never more than the rounded distance
+// to any centroid behind the line.
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+
+#define KD_LEAF 8
+
+typedef struct {
+    double* x;
+    double* y;
+    // Centroid number held in each slot.
+    int* index;
+    unsigned char* axis;
+    int count;
+} Kd_tree;
+
+// Returns 0, or -1 if out of memory.
+static inline int kd_alloc(Kd_tree* tree, int count) {
+    tree->x = malloc(count * sizeof(double));
+    tree->y = malloc(count * sizeof(double));
+    tree->index = malloc(count * sizeof(int));
+    tree->axis = malloc(count);
+    tree->count = 0;
+    return tree->x == NULL || tree->y == NULL || tree->index == NULL || tree->axis == NULL ? -1 : 0;
+}
+
+static inline void kd_free(Kd_tree* tree) {
+    free(tree->x);
+    free(tree->y);
+    free(tree->index);
+    free(tree->axis);
+    tree->x = tree->y = NULL;
+    tree->index = NULL;
+    tree->axis = NULL;
+}
+
+static inline void kd_swap(Kd_tree* tree, int a, int b) {
+    double x = tree->x[a], y = tree->y[a];
+    int index = tree->index[a];
+    tree->x[a] = tree->x[b];
+    tree->y[a] = tree->y[b];
+    tree->index[a] = tree->index[b];
+    tree->x[b] = x;
+    tree->y[b] = y;
+    tree->index[b] = index;
+}
+
+// Quickselect: reorders [lo, hi) so that slot k holds the centroid that
+// sorting by the axis coordinate would put there, nothing before it is
+// larger and nothing after it smaller. The three-way partition keeps runs of
+// equal coordinates, such as repeated centroids, from going quadratic.
+static inline void kd_select(Kd_tree* tree, int lo, int hi, int k, int axis) {
+    const double* key = axis ? tree->y : tree->x;
+    while (hi - lo > 1) {
+        double pivot = key[lo + (hi - lo) / 2];
+        int less = lo, i = lo, greater = hi;
+        while (i < greater) {
+            if (key[i] < pivot) {
+                kd_swap(tree, less++, i++);
+            } else if (key[i] > pivot) {
+                kd_swap(tree, i, --greater);
+            } else {
+                i++;
+            }
+        }
+        if (k < less) {
+            hi = less;
+        } else if (k >= greater) {
+            lo = greater;
+        } else {
+            return;
+        }
+    }
+}
+
+// Splits each range on the coordinate with the wider spread.
+static inline void kd_build_range(Kd_tree* tree, int lo, int hi) {
+    if (hi - lo <= KD_LEAF) {
+        return;
+    }
+    double min_x = INFINITY, max_x = -INFINITY, min_y = INFINITY, max_y = -INFINITY;
+    for (int s = lo; s < hi; s++) {
+        min_x = fmin(min_x, tree->x[s]);
+        max_x = fmax(max_x, tree->x[s]);
+        min_y = fmin(min_y, tree->y[s]);
+        max_y = fmax(max_y, tree->y[s]);
+    }
+    int axis = max_y - min_y > max_x - min_x;
+    int mid = lo + (hi - lo) / 2;
+    kd_select(tree, lo, hi, mid, axis);
+    tree->axis[mid] = axis;
+    kd_build_range(tree, lo, mid);
+    kd_build_range(tree, mid + 1, hi);
+}
+
+// Rebuilds the tree over count centroids; tree must have room for them.
+static inline void kd_build(Kd_tree* tree, const double* cx, const double* cy, int count) {
+    for (int j = 0; j < count; j++) {
+        tree->x[j] = cx[j];
+        tree->y[j] = cy[j];
+        tree->index[j] = j;
+    }
+    tree->count = count;
+    kd_build_range(tree, 0, count);
+}
+
+// Depth of the search stack: one entry per level of the tree, which is about
+// log2(count / KD_LEAF) deep since every split halves the range.
+#define KD_STACK 64
+
+// Nearest centroid to (px, py) that is closer than *best, or as close with a
+// lower centroid number; *best and *best_index are updated in place. The near
+// side of each split is searched first and the far side is pushed with the
+// squared distance to the splitting line, so it is dropped once *best is
+// smaller than that. Returns the number of distances computed.
+static inline long kd_search(const Kd_tree* tree, double px, double py,
+                             double* best, int* best_index) {
+    int stack_lo[KD_STACK], stack_hi[KD_STACK];
+    double stack_bound[KD_STACK];
+    double best_dist = *best;
+    int best_cluster = *best_index;
+    long distances = 0;
+
+    stack_lo[0] = 0;
+    stack_hi[0] = tree->count;
+    stack_bound[0] = 0;
+    int depth = 1;
+
+    while (depth > 0) {
+        depth--;
+        if (stack_bound[depth] > best_dist) {
+            continue;
+        }
+        int lo = stack_lo[depth], hi = stack_hi[depth];
+        while (hi - lo > KD_LEAF) {
+            int mid = lo + (hi - lo) / 2;
+            double dx = px - tree->x[mid];
+            double dy = py - tree->y[mid];
+            double dist = dx * dx + dy * dy;
+            if (dist < best_dist || (dist == best_dist && tree->index[mid] < best_cluster)) {
+                best_dist = dist;
+                best_cluster = tree->index[mid];
+            }
+            distances++;
+            double diff = tree->axis[mid] ? dy : dx;
+            if (diff < 0) {
+                stack_lo[depth] = mid + 1;
+                stack_hi[depth] = hi;
+                hi = mid;
+            } else {
+                stack_lo[depth] = lo;
+                stack_hi[depth] = mid;
+                lo = mid + 1;
+            }
+            stack_bound[depth++] = diff * diff;
+        }
+        for (int s = lo; s < hi; s++) {
+            double dx = px - tree->x[s];
+            double dy = py - tree->y[s];
+            double dist = dx * dx + dy * dy;
+            if (dist < best_dist || (dist == best_dist && tree->index[s] < best_cluster)) {
+                best_dist = dist;
+                best_cluster = tree->index[s];
+            }
+        }
+        distances += hi - lo;
+    }
+    *best = best_dist;
+    *best_index = best_cluster;
+    return distances;
+}
+
+// Nearest centroid of each of count points, with the same answers as a
+// Nearest_fn from distance.h. cx/cy are the centroids the tree was built
+// from. hint, if not NULL, names a centroid to start from for each point
+// (last iteration's is usually right or close), which lets the search skip
+// most of the tree; a tree that is a single leaf is just scanned. Returns
+// the number of distances computed.
+static inline long kd_nearest(const Kd_tree* tree, const double* xs, const double* ys, int count,
+                              const double* cx, const double* cy, const int* hint,
+                              int* nearest) {
+    long distances = 0;
+    for (int i = 0; i < count; i++) {
+        double best = INFINITY;
+        int best_index = -1;
+        if (hint != NULL && tree->count > KD_LEAF) {
+            double dx = xs[i] - cx[hint[i]];
+            double dy = ys[i] - cy[hint[i]];
+            best = dx * dx + dy * dy;
+            best_index = hint[i];
+            distances++;
+        }
+        distances += kd_search(tree, xs[i], ys[i], &best, &best_index);
+        nearest[i] = best_index;
+    }
+    return distances;
+}
+
+#pragma GCC pop_options
+
+#endif
@@ -1,184 +1,1536 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <errno.h>
 #include <stdio.h>
 #include <time.h>
+#include <limits.h>
+#include "distance.h"
+#include "points.h"
+#include "kdtree.h"
 
-#define MAX_POINTS 100000
-#define MAX_CLUSTERS 100
+#define MAX_ITERATIONS 1000
+#define EPSILON 1e-4
+#define CACHE_LINE 64
+// k-means|| sampling rounds; each samples about 2 * K candidates.
+#define SEED_ROUNDS 5
 
+// Per-thread cluster sums. The alignment pads every element of an array of
+// these to whole cache lines, and each thread's arrays are one block of whole
+// cache lines of their own, so two workers never write to the same line.
 typedef struct {
-    double x, y;
-} Point;
+    double* sums_x;
+    double* sums_y;
+    int* counts;
+    long distances;
+    long changed;
+    double cost;
+} __attribute__((aligned(CACHE_LINE))) Partial_sums;
 
+enum init_mode {
+    INIT_FIRST,
+    INIT_PARALLEL
+};
+
+enum assign_mode {
+    ASSIGN_BRUTE,
+    ASSIGN_HAMERLY,
+    ASSIGN_KDTREE
+};
+
+// Phases of one full-batch iteration, timed separately by every worker:
+// finding the nearest centroids and adding up the partial sums, combining
+// the partial sums of all workers, and moving the centroids.
+enum phase {
+    PHASE_ASSIGN,
+    PHASE_REDUCE,
+    PHASE_UPDATE,
+    PHASE_COUNT
+};
+
+static const char* const phase_names[PHASE_COUNT] = {"assign", "reduce", "update"};
+
+// State shared by the worker pool for one clustering run.
 typedef struct {
-    int start, end;
-    Point* points;
-    Point* centroids;
+    // Points and centroids are kept as separate x and y arrays so the
+    // distance kernels can load several points per register.
+    double* points_x;
+    double* points_y;
+    double* centroids_x;
+    double* centroids_y;
+    // point_cluster holds the assignment from the previous iteration while
+    // the workers write the new one to next_cluster.
     int* point_cluster;
+    int* next_cluster;
+    Nearest_fn nearest;
+    int num_points;
     int num_clusters;
-} Thread_data;
+    int num_threads;
+    Partial_sums* partials;
+    enum assign_mode assign_mode;
+    // Hamerly bounds, used only in ASSIGN_HAMERLY mode: upper[i] is at least
+    // the distance from point i to its centroid, lower[i] at most the distance
+    // to any other centroid. drift[j] is how far centroid j moved in the last
+    // update and separation[j] half the distance to its nearest other centroid.
+    double* upper;
+    double* lower;
+    double* drift;
+    double* separation;
+    // k-d tree over the centroids, used only in ASSIGN_KDTREE mode and
+    // rebuilt by worker 0 after every update.
+    Kd_tree tree;
+    // Incremental mode (refresh_interval > 0): the partial sums only carry
+    // the points that changed cluster, applied to running totals, and every
+    // refresh_interval iterations the totals are rebuilt from all points.
+    int refresh_interval;
+    double* totals_x;
+    double* totals_y;
+    int* totals_count;
+    // Distance computations done and points that changed cluster in each
+    // iteration, summed over all workers.
+    long* distance_counts;
+    long* changed_counts;
+    // Wall time of each iteration, from the first worker starting it to
+    // worker 0 leaving its last barrier (iteration_seconds), and per phase
+    // the time of the slowest worker of its barrier step (phase_seconds),
+    // which is what the others wait for; see record_phases.
+    double* iteration_seconds;
+    double (*phase_seconds)[PHASE_COUNT];
+    // Mini-batch mode (batch_size > 0): points_x/points_y hold only the
+    // current batch of num_points points, read by worker 0 from stream. Each
+    // centroid moves towards the mean of its batch points with weight
+    // 1 / seen[j], the number of points it has been given so far, so memory
+    // stays at one batch whatever the size of the file.
+    int batch_size;
+    int max_epochs;
+    Point_stream* stream;
+    const char* path;
+    long* seen;
+    double* epoch_x;
+    double* epoch_y;
+    int epochs;
+    long batches;
+    int done;
+    // k-means|| seeding (INIT_PARALLEL): seed_dist[i] is the squared distance
+    // from point i to its nearest candidate so far and next_cluster[i] that
+    // candidate. The candidates are reduced to num_clusters centroids by
+    // weighted k-means++ at the end.
+    enum init_mode init;
+    unsigned long seed;
+    int compare;
+    double* seed_dist;
+    double* cand_x;
+    double* cand_y;
+    long* cand_weight;
+    int cand_count;
+    int cand_capacity;
+    // Clusters the seeding could not give a centroid of their own, because
+    // the points have fewer than num_clusters distinct positions.
+    int empty_seeds;
+    double seed_seconds;
+    pthread_barrier_t barrier;
+    // moved[i % 2] is set during iteration i by any worker whose centroids
+    // moved more than EPSILON; two slots let one be cleared for the next
+    // iteration while the other is being read.
+    atomic_int moved[2];
+    int iterations;
+    int pin;
+    // Print the phase times of every iteration.
+    int timing;
+} Kmeans;
 
+typedef struct {
+    int index;
+    int start, end;
+    int cluster_start, cluster_end;
+    pthread_t thread;
+    Kmeans* kmeans;
+    // Points this worker sampled in the current k-means|| round, and how
+    // many of its points are closest to each candidate.
+    int* picks;
+    int picks_len, picks_capacity;
+    long* weights;
+    // Time this worker spent in each phase of the current iteration. The
+    // slot is picked by iteration parity, so a worker can start the next
+    // iteration while worker 0 still reads the last one.
+    double phase_seconds[2][PHASE_COUNT];
+    // When this worker started the iteration, and its time in the step after
+    // the update (Hamerly separations or the k-d tree rebuild), which has a
+    // barrier of its own.
+    double iteration_start[2];
+    double follow_seconds[2];
+} Thread_data;
 
-pthread_mutex_t mutexes[MAX_CLUSTERS];
-double cluster_sums_x[MAX_CLUSTERS];
-double cluster_sums_y[MAX_CLUSTERS];
-int cluster_counts[MAX_CLUSTERS];
 
 void write_message(const char* message) {
     write(STDOUT_FILENO, message, strlen(message));
 }
 
-void* assign_clusters(void* arg) {
-    Thread_data* data = (Thread_data*)arg;
+// Hamerly's assignments must match the brute-force kernels' bit for bit, so
+// these distances are rounded the same way, without fused multiply-add (see
+// distance.h).
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+
+double point_distance(const Kmeans* km, int i, int j) {
+    double dx = km->points_x[i] - km->centroids_x[j];
+    double dy = km->points_y[i] - km->centroids_y[j];
+    return sqrt(dx * dx + dy * dy);
+}
+
+// Full search for point i that also returns the runner-up distance.
+int nearest_two(const Kmeans* km, int i, double* best, double* second) {
+    double min_dist = INFINITY, next_dist = INFINITY;
+    int closest_cluster = -1;
+    for (int j = 0; j < km->num_clusters; j++) {
+        double dx = km->points_x[i] - km->centroids_x[j];
+        double dy = km->points_y[i] - km->centroids_y[j];
+        double dist = dx * dx + dy * dy;
+        if (dist < min_dist) {
+            next_dist = min_dist;
+            min_dist = dist;
+            closest_cluster = j;
+        } else if (dist < next_dist) {
+            next_dist = dist;
+        }
+    }
+    *best = sqrt(min_dist);
+    *second = sqrt(next_dist);
+    return closest_cluster;
+}
+
+#pragma GCC pop_options
+
+// Hamerly's algorithm: after moving the bounds by the centroid drift, a point
+// keeps its centroid without any search while its upper bound is below both
+// its lower bound and half the distance from its centroid to the nearest
+// other one. The comparisons are strict, so a skipped point has no other
+// centroid at an equal distance and the brute-force tie rule (lowest index)
+// cannot pick a different one. Returns the number of distances computed.
+long assign_hamerly(Thread_data* data, int iteration) {
+    Kmeans* km = data->kmeans;
+    long distances = 0;
+
+    if (iteration == 0) {
+        for (int i = data->start; i < data->end; i++) {
+            km->next_cluster[i] = nearest_two(km, i, &km->upper[i], &km->lower[i]);
+        }
+        return (long)(data->end - data->start) * km->num_clusters;
+    }
+
+    double max_drift = 0;
+    for (int j = 0; j < km->num_clusters; j++) {
+        max_drift = fmax(max_drift, km->drift[j]);
+    }
 
     for (int i = data->start; i < data->end; i++) {
+        int closest_cluster = km->point_cluster[i];
+        km->next_cluster[i] = closest_cluster;
+        km->upper[i] += km->drift[closest_cluster];
+        km->lower[i] -= max_drift;
+
+        double bound = fmax(km->separation[closest_cluster], km->lower[i]);
+        if (km->upper[i] < bound) {
+            continue;
+        }
+        km->upper[i] = point_distance(km, i, closest_cluster);
+        distances++;
+        if (km->upper[i] < bound) {
+            continue;
+        }
+        km->next_cluster[i] = nearest_two(km, i, &km->upper[i], &km->lower[i]);
+        distances += km->num_clusters;
+    }
+    return distances;
+}
+
+// A full update is one where the sums are rebuilt from every point: always
+// outside incremental mode, and on the first iteration and every
+// refresh_interval-th one inside it.
+int full_update(const Kmeans* km, int iteration) {
+    return km->refresh_interval == 0 || iteration % km->refresh_interval == 0;
+}
+
+void assign_clusters(Thread_data* data, int iteration) {
+    Kmeans* km = data->kmeans;
+    Partial_sums* mine = &km->partials[data->index];
+
+    memset(mine->sums_x, 0, km->num_clusters * sizeof(double));
+    memset(mine->sums_y, 0, km->num_clusters * sizeof(double));
+    memset(mine->counts, 0, km->num_clusters * sizeof(int));
+    mine->distances = mine->changed = 0;
+
+    int start = data->start;
+    if (km->assign_mode == ASSIGN_HAMERLY) {
+        mine->distances = assign_hamerly(data, iteration);
+    } else if (km->assign_mode == ASSIGN_KDTREE) {
+        // From iteration 1 on, last iteration's cluster is the hint.
+        mine->distances = kd_nearest(&km->tree, km->points_x + start, km->points_y + start,
+                                     data->end - start, km->centroids_x, km->centroids_y,
+                                     iteration > 0 ? km->point_cluster + start : NULL,
+                                     km->next_cluster + start);
+    } else {
+        km->nearest(km->points_x + start, km->points_y + start, data->end - start,
+                    km->centroids_x, km->centroids_y, km->num_clusters,
+                    km->next_cluster + start);
+        mine->distances = (long)(data->end - start) * km->num_clusters;
+    }
+
+    int full = full_update(km, iteration);
+    for (int i = start; i < data->end; i++) {
+        int closest_cluster = km->next_cluster[i];
+        int previous = km->point_cluster[i];
+        if (iteration > 0 && closest_cluster != previous) {
+            mine->changed++;
+            if (!full) {
+                mine->sums_x[previous] -= km->points_x[i];
+                mine->sums_y[previous] -= km->points_y[i];
+                mine->counts[previous]--;
+            }
+        }
+        km->point_cluster[i] = closest_cluster;
+        if (full || closest_cluster != previous) {
+            mine->sums_x[closest_cluster] += km->points_x[i];
+            mine->sums_y[closest_cluster] += km->points_y[i];
+            mine->counts[closest_cluster]++;
+        }
+    }
+}
+
+// Half the distance from each centroid in this worker's slice to the nearest
+// other centroid.
+void update_separation(Thread_data* data) {
+    Kmeans* km = data->kmeans;
+    for (int j = data->cluster_start; j < data->cluster_end; j++) {
         double min_dist = INFINITY;
-        int closest_cluster = -1;
+        for (int other = 0; other < km->num_clusters; other++) {
+            if (other == j) {
+                continue;
+            }
+            double dx = km->centroids_x[j] - km->centroids_x[other];
+            double dy = km->centroids_y[j] - km->centroids_y[other];
+            min_dist = fmin(min_dist, dx * dx + dy * dy);
+        }
+        km->separation[j] = sqrt(min_dist) / 2;
+    }
+}
+
+// Each worker owns a slice of the clusters and adds up the partial sums of
+// every thread for those clusters into the totals, always in thread order so
+// the result does not depend on scheduling.
+void reduce_partials(Thread_data* data, int iteration) {
+    Kmeans* km = data->kmeans;
+    int full = full_update(km, iteration);
+
+    for (int j = data->cluster_start; j < data->cluster_end; j++) {
+        double sum_x = 0, sum_y = 0;
+        int count = 0;
+        for (int t = 0; t < km->num_threads; t++) {
+            sum_x += km->partials[t].sums_x[j];
+            sum_y += km->partials[t].sums_y[j];
+            count += km->partials[t].counts[j];
+        }
+        // In incremental mode the partial sums are only the changes since
+        // the last iteration unless this is a full update.
+        if (!full) {
+            sum_x += km->totals_x[j];
+            sum_y += km->totals_y[j];
+            count += km->totals_count[j];
+        }
+        km->totals_x[j] = sum_x;
+        km->totals_y[j] = sum_y;
+        km->totals_count[j] = count;
+    }
+}
+
+// Moves the centroids of this worker's slice to the mean of their points and
+// reports whether any of them moved by more than EPSILON.
+int update_centroids(Thread_data* data) {
+    Kmeans* km = data->kmeans;
+    int moved = 0;
 
-        for (int j = 0; j < data->num_clusters; j++)
-        {
-            double dist = sqrt(pow(data->points[i].x - data->centroids[j].x, 2) +
-                               pow(data->points[i].y - data->centroids[j].y, 2));
-            if (dist < min_dist) {
-                min_dist = dist;
-                closest_cluster = j;
+    for (int j = data->cluster_start; j < data->cluster_end; j++) {
+        int count = km->totals_count[j];
+        if (km->drift != NULL) {
+            km->drift[j] = 0;
+        }
+        if (count > 0) {
+            double next_x = km->totals_x[j] / count;
+            double next_y = km->totals_y[j] / count;
+            if (fabs(next_x - km->centroids_x[j]) > EPSILON ||
+                fabs(next_y - km->centroids_y[j]) > EPSILON) {
+                moved = 1;
+            }
+            if (km->drift != NULL) {
+                double dx = next_x - km->centroids_x[j];
+                double dy = next_y - km->centroids_y[j];
+                km->drift[j] = sqrt(dx * dx + dy * dy);
             }
+            km->centroids_x[j] = next_x;
+            km->centroids_y[j] = next_y;
         }
+    }
+    return moved;
+}
+
+// Mini-batch version of update_centroids for this worker's clusters.
+void update_minibatch(Thread_data* data) {
+    Kmeans* km = data->kmeans;
 
-        data->point_cluster[i] = closest_cluster;
+    for (int j = data->cluster_start; j < data->cluster_end; j++) {
+        double sum_x = 0, sum_y = 0;
+        int count = 0;
+        for (int t = 0; t < km->num_threads; t++) {
+            sum_x += km->partials[t].sums_x[j];
+            sum_y += km->partials[t].sums_y[j];
+            count += km->partials[t].counts[j];
+        }
+        if (count > 0) {
+            km->seen[j] += count;
+            km->centroids_x[j] += (sum_x - count * km->centroids_x[j]) / km->seen[j];
+            km->centroids_y[j] += (sum_y - count * km->centroids_y[j]) / km->seen[j];
+        }
+    }
+}
 
-        pthread_mutex_lock(&mutexes[closest_cluster]);
-        cluster_sums_x[closest_cluster] += data->points[i].x;
-        cluster_sums_y[closest_cluster] += data->points[i].y;
-        cluster_counts[closest_cluster]++;
-        pthread_mutex_unlock(&mutexes[closest_cluster]);
+void pin_to_cpu(int index) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % (cpus > 0 ? cpus : 1), &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        write_message("Could not pin thread to CPU.\n");
     }
+}
 
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// splitmix64 finaliser.
+unsigned long mix64(unsigned long x) {
+    x += 0x9e3779b97f4a7c15UL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+    return x ^ (x >> 31);
+}
+
+// Uniform number in [0, 1) that depends only on the seed, a stream number
+// and an index. Drawing per point instead of from a shared generator keeps
+// the seeding the same however the points are split between threads.
+double seed_unit(unsigned long seed, unsigned long stream, unsigned long index) {
+    unsigned long x = mix64(mix64(seed ^ mix64(stream)) ^ index);
+    return (x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void* seed_alloc(void* p) {
+    if (p == NULL) {
+        write_message("Not enough memory for seeding.\n");
+        exit(1);
+    }
+    return p;
+}
+
+void add_candidate(Kmeans* km, double x, double y) {
+    if (km->cand_count == km->cand_capacity) {
+        km->cand_capacity = km->cand_capacity ? km->cand_capacity * 2 : 64;
+        km->cand_x = seed_alloc(realloc(km->cand_x, km->cand_capacity * sizeof(double)));
+        km->cand_y = seed_alloc(realloc(km->cand_y, km->cand_capacity * sizeof(double)));
+    }
+    km->cand_x[km->cand_count] = x;
+    km->cand_y[km->cand_count] = y;
+    km->cand_count++;
+}
+
+// Weighted k-means++ over the k-means|| candidates, run by worker 0 only:
+// each next centroid is a candidate drawn with probability proportional to
+// weight * squared distance to the centroids already chosen. Stops early once
+// every candidate has a centroid on it; returns how many were placed.
+int reduce_candidates(Kmeans* km) {
+    int count = km->cand_count;
+    double* dist = seed_alloc(malloc(count * sizeof(double)));
+    double total = 0;
+    for (int c = 0; c < count; c++) {
+        dist[c] = INFINITY;
+        total += km->cand_weight[c];
+    }
+
+    int k = 0;
+    while (k < km->num_clusters) {
+        double target = seed_unit(km->seed, SEED_ROUNDS + 1, k) * total;
+        int pick = count - 1;
+        for (int c = 0; c < count; c++) {
+            double mass = k == 0 ? km->cand_weight[c] : km->cand_weight[c] * dist[c];
+            if (target < mass) {
+                pick = c;
+                break;
+            }
+            target -= mass;
+        }
+        km->centroids_x[k] = km->cand_x[pick];
+        km->centroids_y[k] = km->cand_y[pick];
+        k++;
+
+        total = 0;
+        for (int c = 0; c < count; c++) {
+            double dx = km->cand_x[c] - km->cand_x[pick];
+            double dy = km->cand_y[c] - km->cand_y[pick];
+            dist[c] = fmin(dist[c], dx * dx + dy * dy);
+            total += km->cand_weight[c] * dist[c];
+        }
+        if (total == 0) {
+            break;
+        }
+    }
+    free(dist);
+    return k;
+}
+
+// k-means|| came up with fewer than K distinct candidates: the remaining
+// centroids come from plain k-means++ over the points, run by worker 0 only.
+// Returns how many centroids are distinct in the end; if the points run out
+// too, the rest repeat the last one and stay empty.
+int seed_from_points(Kmeans* km, int placed) {
+    double* dist = km->seed_dist;
+    double total = 0;
+    for (int i = 0; i < km->num_points; i++) {
+        dist[i] = INFINITY;
+        for (int k = 0; k < placed; k++) {
+            double dx = km->points_x[i] - km->centroids_x[k];
+            double dy = km->points_y[i] - km->centroids_y[k];
+            dist[i] = fmin(dist[i], dx * dx + dy * dy);
+        }
+        total += dist[i];
+    }
+
+    while (placed < km->num_clusters && total > 0) {
+        double target = seed_unit(km->seed, SEED_ROUNDS + 2, placed) * total;
+        // Rounding can leave target past the end; the last point still
+        // without a centroid then takes it.
+        int pick = -1, last = -1;
+        for (int i = 0; i < km->num_points && pick < 0; i++) {
+            if (dist[i] > 0) {
+                last = i;
+            }
+            if (target < dist[i]) {
+                pick = i;
+            }
+            target -= dist[i];
+        }
+        if (pick < 0) {
+            pick = last;
+        }
+        km->centroids_x[placed] = km->points_x[pick];
+        km->centroids_y[placed] = km->points_y[pick];
+        placed++;
+
+        total = 0;
+        for (int i = 0; i < km->num_points; i++) {
+            double dx = km->points_x[i] - km->points_x[pick];
+            double dy = km->points_y[i] - km->points_y[pick];
+            dist[i] = fmin(dist[i], dx * dx + dy * dy);
+            total += dist[i];
+        }
+    }
+
+    for (int k = placed; k < km->num_clusters; k++) {
+        km->centroids_x[k] = km->centroids_x[placed - 1];
+        km->centroids_y[k] = km->centroids_y[placed - 1];
+    }
+    return placed;
+}
+
+void append_pick(Thread_data* data, int i) {
+    if (data->picks_len == data->picks_capacity) {
+        data->picks_capacity = data->picks_capacity ? data->picks_capacity * 2 : 64;
+        data->picks = seed_alloc(realloc(data->picks, data->picks_capacity * sizeof(int)));
+    }
+    data->picks[data->picks_len++] = i;
+}
+
+// k-means|| (Bahmani et al.) on the worker pool. Starting from one point
+// picked by the seed, each round every worker updates the distances of its
+// own points to the newest candidates and samples each point with
+// probability 2K * dist / total; worker 0 then appends the samples in thread
+// order, which is point order. Finally every candidate is weighted by the
+// number of points closest to it and reduce_candidates picks K of them.
+// For a given seed and thread count the result is always the same.
+void seed_parallel(Thread_data* data) {
+    Kmeans* km = data->kmeans;
+    int start = data->start, end = data->end;
+
+    if (data->index == 0) {
+        km->seed_seconds = now_seconds();
+        int first = mix64(km->seed) % km->num_points;
+        km->cand_count = 0;
+        add_candidate(km, km->points_x[first], km->points_y[first]);
+    }
+    for (int i = start; i < end; i++) {
+        km->seed_dist[i] = INFINITY;
+    }
+    pthread_barrier_wait(&km->barrier);
+
+    int new_from = 0;
+    for (int round = 0; ; round++) {
+        // The nearest of the new candidates comes from the distance kernel;
+        // point_cluster is free during seeding and holds its answers. A
+        // round that sampled nothing leaves the distances as they are.
+        int cand_count = km->cand_count;
+        if (cand_count > new_from) {
+            km->nearest(km->points_x + start, km->points_y + start, end - start,
+                        km->cand_x + new_from, km->cand_y + new_from, cand_count - new_from,
+                        km->point_cluster + start);
+            for (int i = start; i < end; i++) {
+                int c = new_from + km->point_cluster[i];
+                double dx = km->points_x[i] - km->cand_x[c];
+                double dy = km->points_y[i] - km->cand_y[c];
+                double dist = dx * dx + dy * dy;
+                if (dist < km->seed_dist[i]) {
+                    km->seed_dist[i] = dist;
+                    km->next_cluster[i] = c;
+                }
+            }
+        }
+        double cost = 0;
+        for (int i = start; i < end; i++) {
+            cost += km->seed_dist[i];
+        }
+        km->partials[data->index].cost = cost;
+        new_from = cand_count;
+        pthread_barrier_wait(&km->barrier);
+
+        double total = 0;
+        for (int t = 0; t < km->num_threads; t++) {
+            total += km->partials[t].cost;
+        }
+        if (round == SEED_ROUNDS || total == 0) {
+            break;
+        }
+
+        double oversample = 2.0 * km->num_clusters / total;
+        data->picks_len = 0;
+        for (int i = start; i < end; i++) {
+            if (seed_unit(km->seed, round, i) < oversample * km->seed_dist[i]) {
+                append_pick(data, i);
+            }
+        }
+        pthread_barrier_wait(&km->barrier);
+
+        if (data->index == 0) {
+            for (int t = 0; t < km->num_threads; t++) {
+                for (int p = 0; p < data[t].picks_len; p++) {
+                    int i = data[t].picks[p];
+                    add_candidate(km, km->points_x[i], km->points_y[i]);
+                }
+            }
+        }
+        pthread_barrier_wait(&km->barrier);
+    }
+
+    data->weights = seed_alloc(calloc(km->cand_count, sizeof(long)));
+    for (int i = start; i < end; i++) {
+        data->weights[km->next_cluster[i]]++;
+    }
+    pthread_barrier_wait(&km->barrier);
+
+    if (data->index == 0) {
+        free(km->cand_weight);
+        km->cand_weight = seed_alloc(calloc(km->cand_count, sizeof(long)));
+        for (int t = 0; t < km->num_threads; t++) {
+            for (int c = 0; c < km->cand_count; c++) {
+                km->cand_weight[c] += data[t].weights[c];
+            }
+        }
+        int placed = reduce_candidates(km);
+        if (placed < km->num_clusters) {
+            placed = seed_from_points(km, placed);
+        }
+        km->empty_seeds = km->num_clusters - placed;
+        km->seed_seconds = now_seconds() - km->seed_seconds;
+    }
+    pthread_barrier_wait(&km->barrier);
+
+    free(data->weights);
+    free(data->picks);
+    data->weights = NULL;
+    data->picks = NULL;
+    data->picks_len = data->picks_capacity = 0;
+}
+
+// Called by worker 0 once every worker has written its phase times for
+// iteration, with the time worker 0 left the iteration's last barrier;
+// workers is the whole thread_data array, which starts with worker 0's own
+// entry. The iteration runs from the earliest worker start to end. Each
+// barrier step counts with its slowest worker: the longest assign, the
+// reduce/update split of the worker slowest at the two together, and the
+// longest follow-up step. Steps are separated by barriers, so the phases
+// never add up to more than the iteration.
+void record_phases(Thread_data* workers, int iteration, double end) {
+    Kmeans* km = workers->kmeans;
+    int slot = iteration % 2;
+    double start = workers[0].iteration_start[slot];
+    double assign = 0, step = -1, follow = 0;
+    int slowest = 0;
+    for (int t = 0; t < km->num_threads; t++) {
+        const double* phase = workers[t].phase_seconds[slot];
+        start = fmin(start, workers[t].iteration_start[slot]);
+        assign = fmax(assign, phase[PHASE_ASSIGN]);
+        if (phase[PHASE_REDUCE] + phase[PHASE_UPDATE] > step) {
+            step = phase[PHASE_REDUCE] + phase[PHASE_UPDATE];
+            slowest = t;
+        }
+        follow = fmax(follow, workers[t].follow_seconds[slot]);
+    }
+    km->phase_seconds[iteration][PHASE_ASSIGN] = assign;
+    km->phase_seconds[iteration][PHASE_REDUCE] = workers[slowest].phase_seconds[slot][PHASE_REDUCE];
+    km->phase_seconds[iteration][PHASE_UPDATE] = workers[slowest].phase_seconds[slot][PHASE_UPDATE] + follow;
+    km->iteration_seconds[iteration] = end - start;
+}
+
+// Body of every worker, including the main thread as worker 0. Workers are
+// started once and step through the iterations together:
+//   assign own points -> barrier -> reduce and update own clusters ->
+//   barrier -> check.
+// All workers see the same moved flag after the second barrier, so they agree
+// on when to stop without any thread coordinating the others. Hamerly mode
+// adds one more step, computing the centroid separations, and a barrier;
+// k-d tree mode the same for worker 0 rebuilding the tree.
+// Each worker times its phases with the wall clock; time spent waiting at a
+// barrier is not counted in any phase.
+void* kmeans_worker(void* arg) {
+    Thread_data* data = (Thread_data*)arg;
+    Kmeans* km = data->kmeans;
+
+    if (km->pin) {
+        pin_to_cpu(data->index);
+    }
+    if (km->init == INIT_PARALLEL) {
+        seed_parallel(data);
+    }
+    if (km->assign_mode == ASSIGN_KDTREE) {
+        if (data->index == 0) {
+            kd_build(&km->tree, km->centroids_x, km->centroids_y, km->num_clusters);
+        }
+        pthread_barrier_wait(&km->barrier);
+    }
+
+    for (int iteration = 0; ; iteration++) {
+        double* phase = data->phase_seconds[iteration % 2];
+        double start = now_seconds();
+        data->iteration_start[iteration % 2] = start;
+        data->follow_seconds[iteration % 2] = 0;
+        assign_clusters(data, iteration);
+        phase[PHASE_ASSIGN] = now_seconds() - start;
+        pthread_barrier_wait(&km->barrier);
+
+        double reduce_start = now_seconds();
+        if (data->index == 0) {
+            atomic_store_explicit(&km->moved[(iteration + 1) % 2], 0, memory_order_relaxed);
+            long distances = 0, changed = 0;
+            for (int t = 0; t < km->num_threads; t++) {
+                distances += km->partials[t].distances;
+                changed += km->partials[t].changed;
+            }
+            km->distance_counts[iteration] = distances;
+            km->changed_counts[iteration] = changed;
+        }
+        reduce_partials(data, iteration);
+        double update_start = now_seconds();
+        if (update_centroids(data)) {
+            atomic_store_explicit(&km->moved[iteration % 2], 1, memory_order_relaxed);
+        }
+        phase[PHASE_REDUCE] = update_start - reduce_start;
+        phase[PHASE_UPDATE] = now_seconds() - update_start;
+        pthread_barrier_wait(&km->barrier);
+        double end = now_seconds();
+
+        int moved = atomic_load_explicit(&km->moved[iteration % 2], memory_order_relaxed);
+        if (!moved || iteration + 1 > MAX_ITERATIONS) {
+            if (data->index == 0) {
+                km->iterations = iteration + 1;
+                record_phases(data, iteration, end);
+            }
+            break;
+        }
+
+        if (km->assign_mode == ASSIGN_HAMERLY) {
+            double separation_start = now_seconds();
+            update_separation(data);
+            data->follow_seconds[iteration % 2] = now_seconds() - separation_start;
+            pthread_barrier_wait(&km->barrier);
+            end = now_seconds();
+        } else if (km->assign_mode == ASSIGN_KDTREE) {
+            if (data->index == 0) {
+                double build_start = now_seconds();
+                kd_build(&km->tree, km->centroids_x, km->centroids_y, km->num_clusters);
+                data->follow_seconds[iteration % 2] = now_seconds() - build_start;
+            }
+            pthread_barrier_wait(&km->barrier);
+            end = now_seconds();
+        }
+        if (data->index == 0) {
+            record_phases(data, iteration, end);
+        }
+    }
     return NULL;
 }
 
-void update_centroids(Point* centroids, int num_clusters) {
-    for (int i = 0; i < num_clusters; i++) {
-        if (cluster_counts[i] > 0) {
-            centroids[i].x = cluster_sums_x[i] / cluster_counts[i];
-            centroids[i].y = cluster_sums_y[i] / cluster_counts[i];
+// Loads the next batch. At the end of the file an epoch is over: the run
+// stops if no centroid moved more than EPSILON during it or max_epochs is
+// reached, otherwise the file is read again from the start.
+void next_batch(Kmeans* km) {
+    int count = stream_read(km->stream, km->points_x, km->points_y, km->batch_size);
+    if (count == 0 && !km->stream->error) {
+        km->epochs++;
+        int moved = 0;
+        for (int j = 0; j < km->num_clusters; j++) {
+            if (fabs(km->centroids_x[j] - km->epoch_x[j]) > EPSILON ||
+                fabs(km->centroids_y[j] - km->epoch_y[j]) > EPSILON) {
+                moved = 1;
+            }
+            km->epoch_x[j] = km->centroids_x[j];
+            km->epoch_y[j] = km->centroids_y[j];
+        }
+        if (moved && km->epochs < km->max_epochs) {
+            stream_rewind(km->stream);
+            count = stream_read(km->stream, km->points_x, km->points_y, km->batch_size);
         }
     }
+    km->num_points = count;
+    km->done = count == 0;
+    if (!km->done) {
+        km->batches++;
+    }
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        write_message("Usage: ./program <num_clusters> <num_threads>\n");
-        return 1;
+// Worker body for mini-batch mode:
+//   worker 0 reads a batch -> barrier -> assign own share of the batch ->
+//   barrier -> update own clusters -> barrier.
+// The last barrier keeps worker 0 from checking the epoch while centroids
+// are still being moved.
+void* minibatch_worker(void* arg) {
+    Thread_data* data = (Thread_data*)arg;
+    Kmeans* km = data->kmeans;
+
+    if (km->pin) {
+        pin_to_cpu(data->index);
+    }
+    if (km->init == INIT_PARALLEL) {
+        // Seeds from the first batch, already loaded by run_minibatch.
+        data->start = (long)km->num_points * data->index / km->num_threads;
+        data->end = (long)km->num_points * (data->index + 1) / km->num_threads;
+        seed_parallel(data);
+        if (data->index == 0) {
+            memcpy(km->epoch_x, km->centroids_x, km->num_clusters * sizeof(double));
+            memcpy(km->epoch_y, km->centroids_y, km->num_clusters * sizeof(double));
+        }
     }
 
-    int num_clusters = atoi(argv[1]);
-    int num_threads = atoi(argv[2]);
+    for (;;) {
+        if (data->index == 0) {
+            next_batch(km);
+        }
+        pthread_barrier_wait(&km->barrier);
+        if (km->done) {
+            break;
+        }
 
-    if (num_clusters > MAX_CLUSTERS || num_threads < 1) {
-        write_message("Invalid number of clusters or threads.\n");
-        return 1;
+        data->start = (long)km->num_points * data->index / km->num_threads;
+        data->end = (long)km->num_points * (data->index + 1) / km->num_threads;
+        assign_clusters(data, 0);
+        pthread_barrier_wait(&km->barrier);
+
+        update_minibatch(data);
+        pthread_barrier_wait(&km->barrier);
     }
+    return NULL;
+}
 
-    int num_points = 10000;
-    Point points[num_points];
-    Point centroids[num_clusters];
-    Point prev_centroids[num_clusters];
-    int point_cluster[num_points];
+// Starts workers 1..num_threads-1 on worker(), runs worker 0 on the calling
+// thread and waits for all of them.
+int run_workers(Kmeans* km, Thread_data* thread_data, void* (*worker)(void*)) {
+    int num_threads = km->num_threads;
+    for (int i = 0; i < num_threads; i++) {
+        thread_data[i].index = i;
+        thread_data[i].cluster_start = (long)km->num_clusters * i / num_threads;
+        thread_data[i].cluster_end = (long)km->num_clusters * (i + 1) / num_threads;
+        thread_data[i].kmeans = km;
+    }
 
-    pthread_t threads[num_threads];
-    Thread_data thread_data[num_threads];
+    int started = 1;
+    for (int i = 1; i < num_threads; i++) {
+        if (pthread_create(&thread_data[i].thread, NULL, worker, &thread_data[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started < num_threads) {
+        // The barrier counts every worker, so a partial pool would deadlock.
+        write_message("Could not start worker threads.\n");
+        exit(1);
+    }
+
+    worker(&thread_data[0]);
+
+    for (int i = 1; i < num_threads; i++) {
+        pthread_join(thread_data[i].thread, NULL);
+    }
+    return 0;
+}
 
-    FILE* file = fopen("test", "r");
+// Sum of squared distances from each point to its nearest centroid; nearest
+// is scratch space for count cluster numbers.
+double inertia(Kmeans* km, const double* xs, const double* ys, int count, int* nearest) {
+    if (km->assign_mode == ASSIGN_KDTREE) {
+        kd_build(&km->tree, km->centroids_x, km->centroids_y, km->num_clusters);
+        kd_nearest(&km->tree, xs, ys, count, km->centroids_x, km->centroids_y, NULL, nearest);
+    } else {
+        km->nearest(xs, ys, count, km->centroids_x, km->centroids_y, km->num_clusters, nearest);
+    }
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+        double dx = xs[i] - km->centroids_x[nearest[i]];
+        double dy = ys[i] - km->centroids_y[nearest[i]];
+        total += dx * dx + dy * dy;
+    }
+    return total;
+}
+
+void print_centroids(const Kmeans* km) {
+    for (int j = 0; j < km->num_clusters; ++j)
+    {
+        printf("Cluster %d: %lf %lf\n", j + 1, km->centroids_x[j], km->centroids_y[j]);
+    }
+}
+
+void free_kmeans(Kmeans* km) {
+    pthread_barrier_destroy(&km->barrier);
+    if (km->partials != NULL) {
+        for (int t = 0; t < km->num_threads; t++) {
+            free(km->partials[t].sums_x);
+        }
+    }
+    free(km->partials);
+    free(km->centroids_x);
+    free(km->centroids_y);
+    free(km->points_x);
+    free(km->points_y);
+    free(km->point_cluster);
+    free(km->next_cluster);
+    free(km->upper);
+    free(km->lower);
+    free(km->drift);
+    free(km->separation);
+    kd_free(&km->tree);
+    free(km->totals_x);
+    free(km->totals_y);
+    free(km->totals_count);
+    free(km->distance_counts);
+    free(km->changed_counts);
+    free(km->iteration_seconds);
+    free(km->phase_seconds);
+    free(km->seen);
+    free(km->epoch_x);
+    free(km->epoch_y);
+    free(km->seed_dist);
+    free(km->cand_x);
+    free(km->cand_y);
+    free(km->cand_weight);
+    if (km->stream != NULL) {
+        stream_close(km->stream);
+    }
+}
+
+// Centroids, per-thread sums and the barrier for km->num_threads workers.
+int setup_pool(Kmeans* km) {
+    int num_clusters = km->num_clusters;
+    size_t block = num_clusters * (2 * sizeof(double) + sizeof(int));
+    block = (block + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+
+    pthread_barrier_init(&km->barrier, NULL, km->num_threads);
+    km->centroids_x = malloc(num_clusters * sizeof(double));
+    km->centroids_y = malloc(num_clusters * sizeof(double));
+    km->partials = aligned_alloc(CACHE_LINE, km->num_threads * sizeof(Partial_sums));
+    if (km->centroids_x == NULL || km->centroids_y == NULL || km->partials == NULL) {
+        write_message("Not enough memory for per-thread sums.\n");
+        return 1;
+    }
+    memset(km->partials, 0, km->num_threads * sizeof(Partial_sums));
+    for (int t = 0; t < km->num_threads; t++) {
+        Partial_sums* partial = &km->partials[t];
+        partial->sums_x = aligned_alloc(CACHE_LINE, block);
+        if (partial->sums_x == NULL) {
+            write_message("Not enough memory for per-thread sums.\n");
+            return 1;
+        }
+        partial->sums_y = partial->sums_x + num_clusters;
+        partial->counts = (int*)(partial->sums_y + num_clusters);
+    }
+    return 0;
+}
 
-    for (int i = 0; i < num_points; i++) {
-        if (fscanf(file, "%lf %lf", &points[i].x, &points[i].y) != 2) {
-            fprintf(stderr, "Error reading point %d from file\n", i);
-            fclose(file);
+// Allocates what a full-batch run needs besides the points and centroids and
+// splits the points between the workers.
+int prepare_full(Kmeans* km, Thread_data* thread_data) {
+    int num_points = km->num_points;
+    int num_clusters = km->num_clusters;
+    int num_threads = km->num_threads;
+    km->distance_counts = malloc((MAX_ITERATIONS + 1) * sizeof(long));
+    km->changed_counts = malloc((MAX_ITERATIONS + 1) * sizeof(long));
+    km->iteration_seconds = malloc((MAX_ITERATIONS + 1) * sizeof(double));
+    km->phase_seconds = malloc((MAX_ITERATIONS + 1) * sizeof(*km->phase_seconds));
+    km->point_cluster = malloc(num_points * sizeof(int));
+    km->next_cluster = malloc(num_points * sizeof(int));
+    km->totals_x = malloc(num_clusters * sizeof(double));
+    km->totals_y = malloc(num_clusters * sizeof(double));
+    km->totals_count = malloc(num_clusters * sizeof(int));
+    if (km->distance_counts == NULL || km->changed_counts == NULL ||
+        km->iteration_seconds == NULL || km->phase_seconds == NULL ||
+        km->point_cluster == NULL || km->next_cluster == NULL || km->totals_x == NULL ||
+        km->totals_y == NULL || km->totals_count == NULL) {
+        write_message("Not enough memory for the assignments.\n");
+        return 1;
+    }
+    if (km->assign_mode == ASSIGN_HAMERLY) {
+        km->upper = malloc(num_points * sizeof(double));
+        km->lower = malloc(num_points * sizeof(double));
+        km->drift = malloc(num_clusters * sizeof(double));
+        km->separation = malloc(num_clusters * sizeof(double));
+        if (km->upper == NULL || km->lower == NULL || km->drift == NULL || km->separation == NULL) {
+            write_message("Not enough memory for Hamerly bounds.\n");
             return 1;
         }
     }
+    if (km->assign_mode == ASSIGN_KDTREE && kd_alloc(&km->tree, num_clusters) != 0) {
+        write_message("Not enough memory for the k-d tree.\n");
+        return 1;
+    }
 
-    fclose(file);
+    if (km->init == INIT_PARALLEL || km->compare) {
+        km->seed_dist = malloc(num_points * sizeof(double));
+        if (km->seed_dist == NULL) {
+            write_message("Not enough memory for seeding.\n");
+            return 1;
+        }
+    }
 
-    for (int i = 0; i < num_clusters; i++) {
-        pthread_mutex_init(&mutexes[i], NULL);
+    int chunk_size = (num_points + num_threads - 1) / num_threads;
+    for (int i = 0; i < num_threads; i++) {
+        Thread_data* data = &thread_data[i];
+        data->start = i * chunk_size < num_points ? i * chunk_size : num_points;
+        data->end = (i + 1) * chunk_size > num_points ? num_points : (i + 1) * chunk_size;
     }
+    return 0;
+}
 
-    clock_t start_time = clock();
+// One full-batch run from seeding to convergence on the loaded points.
+// Returns the wall time.
+double cluster_full(Kmeans* km, Thread_data* thread_data) {
+    atomic_store(&km->moved[0], 0);
+    atomic_store(&km->moved[1], 0);
+    km->seed_seconds = 0;
 
-    for (int i = 0; i < num_clusters; i++) {
-        centroids[i] = points[i];
+    double start = now_seconds();
+    if (km->init == INIT_FIRST) {
+        for (int i = 0; i < km->num_clusters; i++) {
+            km->centroids_x[i] = km->points_x[i];
+            km->centroids_y[i] = km->points_y[i];
+        }
     }
+    run_workers(km, thread_data, kmeans_worker);
+    return now_seconds() - start;
+}
 
-    int flag = 0, iterations = 0;
-    while (!flag) {
-        for (int i = 0; i < num_clusters; i++) {
-            prev_centroids[i] = centroids[i];
+// Phase times of the last run summed over its iterations; the last slot is
+// the rest of the iteration time, mostly spent waiting at barriers.
+void sum_phases(const Kmeans* km, double totals[PHASE_COUNT + 1]) {
+    double wall = 0;
+    memset(totals, 0, (PHASE_COUNT + 1) * sizeof(double));
+    for (int i = 0; i < km->iterations; i++) {
+        wall += km->iteration_seconds[i];
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            totals[p] += km->phase_seconds[i][p];
         }
+    }
+    totals[PHASE_COUNT] = wall;
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        totals[PHASE_COUNT] -= totals[p];
+    }
+}
 
-        memset(cluster_sums_x, 0, sizeof(cluster_sums_x));
-        memset(cluster_sums_y, 0, sizeof(cluster_sums_y));
-        memset(cluster_counts, 0, sizeof(cluster_counts));
+// Loads the whole file into set and points km at it.
+int load_full(Kmeans* km, Point_set* set) {
+    int status = points_load(km->path, km->num_threads, set);
+    if (status == -1) {
+        perror(km->path);
+        return 1;
+    }
+    if (status == -2) {
+        fprintf(stderr, "Error reading point %ld from file\n", set->error_at);
+        return 1;
+    }
+    if (status == -3 || set->count > INT_MAX) {
+        write_message("Not enough memory for the points.\n");
+        return 1;
+    }
+    if (set->count < km->num_clusters) {
+        write_message("Fewer points than clusters.\n");
+        return 1;
+    }
+    km->points_x = set->xs;
+    km->points_y = set->ys;
+    km->num_points = set->count;
+    return 0;
+}
+
+// Classic k-means with every point in memory.
+int run_full(Kmeans* km, Thread_data* thread_data) {
+    Point_set set;
+    double load_start = now_seconds();
+    int status = load_full(km, &set);
+    double load_seconds = now_seconds() - load_start;
+    if (status != 0) {
+        return 1;
+    }
+
+    int num_points = km->num_points;
+    int num_clusters = km->num_clusters;
+    if (prepare_full(km, thread_data) != 0) {
+        return 1;
+    }
+
+    int naive_iterations = 0;
+    double naive_seconds = 0;
+    enum init_mode init = km->init;
+    if (km->compare) {
+        km->init = INIT_FIRST;
+        naive_seconds = cluster_full(km, thread_data);
+        naive_iterations = km->iterations;
+        km->init = init;
+    }
+
+    double seconds = cluster_full(km, thread_data);
 
+    int iterations = km->iterations;
+    if (iterations > MAX_ITERATIONS) {
+        write_message("Iteration limit reached. Stopping.\n");
+    }
 
-        int chunk_size = (num_points + num_threads - 1) / num_threads;
-        for (int i = 0; i < num_threads; i++) {
-            thread_data[i].start = i * chunk_size;
-            thread_data[i].end = (i + 1) * chunk_size > num_points ? num_points : (i + 1) * chunk_size;
-            thread_data[i].points = points;
-            thread_data[i].centroids = centroids;
-            thread_data[i].point_cluster = point_cluster;
-            thread_data[i].num_clusters = num_clusters;
+    printf("Clustering completed in %d iterations.\n", iterations);
+    print_centroids(km);
 
-            pthread_create(&threads[i], NULL, assign_clusters, &thread_data[i]);
+    if (km->assign_mode != ASSIGN_BRUTE || km->refresh_interval > 0) {
+        long full = (long)num_points * num_clusters;
+        for (int i = 0; i < iterations; i++) {
+            printf("Iteration %d: %ld distances computed, %ld skipped (%.1f%%), %ld points changed cluster\n",
+                   i + 1, km->distance_counts[i], full - km->distance_counts[i],
+                   100.0 * (full - km->distance_counts[i]) / full, km->changed_counts[i]);
+        }
+    }
+    if (km->timing) {
+        for (int i = 0; i < iterations; i++) {
+            printf("Iteration %d time: %.6f seconds (", i + 1, km->iteration_seconds[i]);
+            for (int p = 0; p < PHASE_COUNT; p++) {
+                printf("%s%s %.6f", p > 0 ? ", " : "", phase_names[p], km->phase_seconds[i][p]);
+            }
+            printf(")\n");
         }
+    }
 
-        for (int i = 0; i < num_threads; i++) {
-            pthread_join(threads[i], NULL);
+    double phases[PHASE_COUNT + 1];
+    sum_phases(km, phases);
+    printf("Load time: %.6f seconds (%d points, %s)\n", load_seconds, num_points,
+           set.binary ? "binary" : "text");
+    printf("Execution time: %.6f seconds\n", seconds);
+    printf("Phase times: seed %.6f, assign %.6f, reduce %.6f, update %.6f, waiting %.6f seconds\n",
+           km->seed_seconds, phases[PHASE_ASSIGN], phases[PHASE_REDUCE], phases[PHASE_UPDATE],
+           phases[PHASE_COUNT]);
+    if (init == INIT_PARALLEL) {
+        printf("Seeding: k-means|| with seed %lu, %.6f seconds\n", km->seed, km->seed_seconds);
+        if (km->empty_seeds > 0) {
+            printf("Seeding: fewer distinct points than clusters, %d clusters start empty\n",
+                   km->empty_seeds);
         }
+    }
+    if (km->compare) {
+        printf("First-points seeding: %d iterations, %.6f seconds wall\n", naive_iterations, naive_seconds);
+        printf("%s seeding: %d iterations, %.6f seconds wall\n",
+               init == INIT_PARALLEL ? "k-means||" : "First-points", iterations, seconds);
+    }
 
-        update_centroids(centroids, num_clusters);
+    double total = inertia(km, km->points_x, km->points_y, num_points, km->next_cluster);
+    printf("Inertia: %lf (%lf per point)\n", total, total / num_points);
+
+    points_free(&set);
+    km->points_x = km->points_y = NULL;
+    free_kmeans(km);
+    return 0;
+}
 
-        flag = 1;
-        for (int i = 0; i < num_clusters; i++) {
-            if (fabs(centroids[i].x - prev_centroids[i].x) > 1e-4 ||
-                fabs(centroids[i].y - prev_centroids[i].y) > 1e-4) {
-                flag = 0;
+// Fills xs/ys with count points drawn from num_clusters round Gaussian blobs
+// whose centres are spread uniformly over [-100, 100]^2. Each point picks its
+// blob at random, so the first points do not fall one per blob.
+void generate_points(double* xs, double* ys, int count, int num_clusters, unsigned long seed) {
+    for (int i = 0; i < count; i++) {
+        int blob = (int)(seed_unit(seed, 0, i) * num_clusters);
+        double centre_x = seed_unit(seed, 1, blob) * 200 - 100;
+        double centre_y = seed_unit(seed, 2, blob) * 200 - 100;
+        // Box-Muller; 1 - u keeps the logarithm finite.
+        double radius = 2 * sqrt(-2 * log(1 - seed_unit(seed, 3, i)));
+        double angle = 2 * M_PI * seed_unit(seed, 4, i);
+        xs[i] = centre_x + radius * cos(angle);
+        ys[i] = centre_y + radius * sin(angle);
+    }
+}
+
+// Scaling benchmark. For 10, 20, 50, 100, ... clusters up to max_clusters it
+// generates num_points points around that many blobs and clusters them with
+// 1, 2, 4, ... up to max_threads workers, printing one CSV row per run.
+// Speedup and efficiency are against the one-thread run on the same data;
+// the other settings (kernel, assignment mode, seeding) come from base.
+int run_bench(const Kmeans* base, int num_points, int max_clusters, int max_threads) {
+    double* xs = malloc(num_points * sizeof(double));
+    double* ys = malloc(num_points * sizeof(double));
+    if (xs == NULL || ys == NULL) {
+        write_message("Not enough memory for the points.\n");
+        return 1;
+    }
+
+    printf("points,clusters,threads,iterations,seconds,seed,assign,reduce,update,waiting,speedup,efficiency\n");
+    int num_clusters = max_clusters < 10 ? max_clusters : 10;
+    for (;;) {
+        generate_points(xs, ys, num_points, num_clusters, base->seed);
+        double single = 0;
+        for (int num_threads = 1; ; ) {
+            Kmeans km = *base;
+            km.points_x = xs;
+            km.points_y = ys;
+            km.num_points = num_points;
+            km.num_clusters = num_clusters;
+            km.num_threads = num_threads;
+            Thread_data* thread_data = calloc(num_threads, sizeof(Thread_data));
+            if (thread_data == NULL) {
+                write_message("Not enough memory for a benchmark run.\n");
+                return 1;
+            }
+            if (setup_pool(&km) != 0 || prepare_full(&km, thread_data) != 0) {
+                return 1;
+            }
+
+            double seconds = cluster_full(&km, thread_data);
+            if (num_threads == 1) {
+                single = seconds;
+            }
+            double phases[PHASE_COUNT + 1];
+            sum_phases(&km, phases);
+            printf("%d,%d,%d,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.3f,%.3f\n", num_points,
+                   num_clusters, num_threads, km.iterations, seconds, km.seed_seconds,
+                   phases[PHASE_ASSIGN], phases[PHASE_REDUCE], phases[PHASE_UPDATE],
+                   phases[PHASE_COUNT], single / seconds, single / seconds / num_threads);
+            fflush(stdout);
+
+            free(thread_data);
+            km.points_x = km.points_y = NULL;
+            free_kmeans(&km);
+
+            if (num_threads == max_threads) {
                 break;
             }
+            num_threads = num_threads * 2 < max_threads ? num_threads * 2 : max_threads;
         }
 
-        iterations++;
-
-        if (iterations > 1000) {
-            write_message("Iteration limit reached. Stopping.\n");
+        if (num_clusters == max_clusters) {
             break;
         }
+        // 10, 20, 50, 100, ...
+        int digit = num_clusters;
+        while (digit % 10 == 0) {
+            digit /= 10;
+        }
+        int next = digit == 2 ? num_clusters / 2 * 5 : num_clusters * 2;
+        num_clusters = next < max_clusters ? next : max_clusters;
     }
 
-    printf("Clustering completed in %d iterations.\n", iterations);
-    for (int j = 0; j < num_clusters; ++j)
-    {
-        printf("Cluster %d: %lf %lf\n", j + 1, centroids[j].x, centroids[j].y);
+    free(xs);
+    free(ys);
+    return 0;
+}
+
+// -c in mini-batch mode: full-batch k-means on the same file with the same
+// seeding and threads, the result the mini-batch one is measured against.
+// Returns its inertia, or -1 if it could not run.
+double reference_inertia(const Kmeans* km, int* iterations, double* seconds) {
+    Kmeans full = {
+        .nearest = km->nearest,
+        .num_clusters = km->num_clusters,
+        .num_threads = km->num_threads,
+        .assign_mode = ASSIGN_BRUTE,
+        .path = km->path,
+        .init = km->init,
+        .seed = km->seed,
+        .pin = km->pin,
+    };
+    Thread_data thread_data[km->num_threads];
+    memset(thread_data, 0, sizeof(thread_data));
+
+    Point_set set;
+    double total = -1;
+    if (setup_pool(&full) == 0 && load_full(&full, &set) == 0) {
+        if (prepare_full(&full, thread_data) == 0) {
+            *seconds = cluster_full(&full, thread_data);
+            *iterations = full.iterations;
+            total = inertia(&full, full.points_x, full.points_y, full.num_points, full.next_cluster);
+        }
+        points_free(&set);
+        full.points_x = full.points_y = NULL;
+    }
+    free_kmeans(&full);
+    return total;
+}
+
+// Mini-batch k-means streamed from the file; only one batch is in memory.
+// Seeds from the first num_clusters points like run_full, then finishes
+// with one more pass over the file to measure the inertia of the result,
+// and with -c a full-batch run to compare it with.
+int run_minibatch(Kmeans* km, Thread_data* thread_data) {
+    int num_clusters = km->num_clusters;
+    int batch_size = km->batch_size < num_clusters ? num_clusters : km->batch_size;
+    km->batch_size = batch_size;
+    km->points_x = malloc(batch_size * sizeof(double));
+    km->points_y = malloc(batch_size * sizeof(double));
+    km->point_cluster = malloc(batch_size * sizeof(int));
+    km->next_cluster = malloc(batch_size * sizeof(int));
+    km->seen = calloc(num_clusters, sizeof(long));
+    km->epoch_x = malloc(num_clusters * sizeof(double));
+    km->epoch_y = malloc(num_clusters * sizeof(double));
+    if (km->points_x == NULL || km->points_y == NULL || km->point_cluster == NULL ||
+        km->next_cluster == NULL || km->seen == NULL || km->epoch_x == NULL || km->epoch_y == NULL) {
+        write_message("Not enough memory for a batch.\n");
+        return 1;
     }
 
-    printf("Execution time: %.6f seconds\n", (double)(clock() - start_time) / CLOCKS_PER_SEC);
+    if (km->init == INIT_PARALLEL) {
+        km->seed_dist = malloc(batch_size * sizeof(double));
+        if (km->seed_dist == NULL) {
+            write_message("Not enough memory for seeding.\n");
+            return 1;
+        }
+    }
 
+    // k-means|| seeds from the whole first batch, the default from its first
+    // num_clusters points.
+    int first = stream_read(km->stream, km->points_x, km->points_y,
+                            km->init == INIT_PARALLEL ? batch_size : num_clusters);
+    km->num_points = first;
+    if (km->stream->error) {
+        fprintf(stderr, "Error reading point %ld from file\n", km->stream->count);
+        return 1;
+    }
+    if (first < num_clusters) {
+        write_message("Fewer points than clusters.\n");
+        return 1;
+    }
     for (int i = 0; i < num_clusters; i++) {
-        pthread_mutex_destroy(&mutexes[i]);
+        km->centroids_x[i] = km->epoch_x[i] = km->points_x[i];
+        km->centroids_y[i] = km->epoch_y[i] = km->points_y[i];
     }
+    stream_rewind(km->stream);
 
+    double start = now_seconds();
+    run_workers(km, thread_data, minibatch_worker);
+    double seconds = now_seconds() - start;
 
+    if (km->stream->error) {
+        fprintf(stderr, "Error reading point %ld from file\n", km->stream->count);
+        return 1;
+    }
+    if (km->epochs >= km->max_epochs) {
+        write_message("Epoch limit reached. Stopping.\n");
+    }
+
+    printf("Clustering completed in %d epochs (%ld batches of up to %d points).\n",
+           km->epochs, km->batches, batch_size);
+    print_centroids(km);
+    printf("Execution time: %.6f seconds\n", seconds);
+    if (km->init == INIT_PARALLEL) {
+        printf("Seeding: k-means|| with seed %lu, %.6f seconds\n", km->seed, km->seed_seconds);
+        if (km->empty_seeds > 0) {
+            printf("Seeding: fewer distinct points in the first batch than clusters, %d clusters start empty\n",
+                   km->empty_seeds);
+        }
+    }
+
+    double total = 0;
+    long points = 0;
+    int count;
+    stream_rewind(km->stream);
+    while ((count = stream_read(km->stream, km->points_x, km->points_y, batch_size)) > 0) {
+        total += inertia(km, km->points_x, km->points_y, count, km->next_cluster);
+        points += count;
+    }
+    printf("Inertia: %lf (%lf per point)\n", total, total / points);
+
+    if (km->compare) {
+        int iterations = 0;
+        double full_seconds = 0;
+        double full_total = reference_inertia(km, &iterations, &full_seconds);
+        if (full_total < 0) {
+            free_kmeans(km);
+            return 1;
+        }
+        printf("Full-batch reference: %d iterations, %.6f seconds wall\n", iterations, full_seconds);
+        printf("Full-batch inertia: %lf (%lf per point), mini-batch / full-batch %.6f\n",
+               full_total, full_total / points, total / full_total);
+    }
+
+    free_kmeans(km);
     return 0;
 }
 
+void usage(void) {
+    write_message("Usage: ./program [-p] [-k scalar|sse2|avx2|avx512] [-f file] [-a brute|hamerly|kdtree] [-u refresh] [-b batch [-e epochs]] [-i first|parallel] [-s seed] [-c] [-t] [-B points] <num_clusters> <num_threads>\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    int pin = 0;
+    int kernel = best_kernel();
+    enum assign_mode assign_mode = ASSIGN_BRUTE;
+    int refresh_interval = 0;
+    int batch_size = 0;
+    int max_epochs = 10;
+    const char* path = "test";
+    enum init_mode init = INIT_FIRST;
+    unsigned long seed = 1;
+    int compare = 0;
+    int timing = 0;
+    int bench_points = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "pk:a:u:b:e:f:i:s:ctB:")) != -1) {
+        switch (opt) {
+            case 'p': pin = 1; break;
+            case 'c': compare = 1; break;
+            case 't': timing = 1; break;
+            case 'B':
+                bench_points = atoi(optarg);
+                if (bench_points < 1) {
+                    usage();
+                }
+                break;
+            case 's': seed = strtoul(optarg, NULL, 10); break;
+            case 'i':
+                if (strcmp(optarg, "first") == 0) {
+                    init = INIT_FIRST;
+                } else if (strcmp(optarg, "parallel") == 0) {
+                    init = INIT_PARALLEL;
+                } else {
+                    usage();
+                }
+                break;
+            case 'f': path = optarg; break;
+            case 'u':
+                refresh_interval = atoi(optarg);
+                if (refresh_interval < 1) {
+                    usage();
+                }
+                break;
+            case 'b':
+                batch_size = atoi(optarg);
+                if (batch_size < 1) {
+                    usage();
+                }
+                break;
+            case 'e':
+                max_epochs = atoi(optarg);
+                if (max_epochs < 1) {
+                    usage();
+                }
+                break;
+            case 'a':
+                if (strcmp(optarg, "brute") == 0) {
+                    assign_mode = ASSIGN_BRUTE;
+                } else if (strcmp(optarg, "hamerly") == 0) {
+                    assign_mode = ASSIGN_HAMERLY;
+                } else if (strcmp(optarg, "kdtree") == 0) {
+                    assign_mode = ASSIGN_KDTREE;
+                } else {
+                    usage();
+                }
+                break;
+            case 'k':
+                kernel = kernel_by_name(optarg);
+                if (kernel < 0) {
+                    usage();
+                }
+                if (!kernel_supported(kernel)) {
+                    write_message("This CPU does not support the requested kernel.\n");
+                    return 1;
+                }
+                break;
+            default: usage();
+        }
+    }
+
+    if (argc - optind < 2) {
+        usage();
+    }
+
+    int num_clusters = atoi(argv[optind]);
+    int num_threads = atoi(argv[optind + 1]);
+
+    if (num_clusters < 1 || num_threads < 1) {
+        write_message("Invalid number of clusters or threads.\n");
+        return 1;
+    }
+    if (batch_size > 0 && (assign_mode != ASSIGN_BRUTE || refresh_interval > 0)) {
+        write_message("Mini-batch mode supports only -a brute without -u.\n");
+        return 1;
+    }
+    if (bench_points > 0 && (batch_size > 0 || bench_points < num_clusters)) {
+        write_message("The benchmark needs full-batch mode and at least as many points as clusters.\n");
+        return 1;
+    }
 
+    Point_stream stream;
+    if (batch_size > 0 && stream_open(&stream, path) == -1) {
+        perror(path);
+        return 1;
+    }
 
+    Kmeans km = {
+        .nearest = kernel_functions[kernel],
+        .num_clusters = num_clusters,
+        .num_threads = num_threads,
+        .assign_mode = assign_mode,
+        .refresh_interval = refresh_interval,
+        .batch_size = batch_size,
+        .max_epochs = max_epochs,
+        .path = path,
+        .stream = batch_size > 0 ? &stream : NULL,
+        .init = init,
+        .seed = seed,
+        .compare = compare,
+        .pin = pin,
+        .timing = timing,
+    };
+    if (bench_points > 0) {
+        km.compare = 0;
+        return run_bench(&km, bench_points, num_clusters, num_threads);
+    }
 
+    Thread_data thread_data[num_threads];
+    memset(thread_data, 0, sizeof(thread_data));
 
+    if (setup_pool(&km) != 0) {
+        return 1;
+    }
 
+    return batch_size > 0 ? run_minibatch(&km, thread_data) : run_full(&km, thread_data);
+}
@@ -0,0 +1,482 @@
+#ifndef LAB_2_POINTS_H
+#define LAB_2_POINTS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Point files for lab_2. Two formats are accepted everywhere:
+//
+//   text    two numbers per line, "x y", as fscanf("%lf %lf") reads them
+//   binary  a 16-byte header (POINTS_MAGIC, then the point count as a
+//           little-endian uint64), followed by all x values and then all y
+//           values as doubles. The layout matches the x/y arrays the
+//           clustering code uses, so a mapped file needs no parsing.
+//
+// Formats are told apart by the magic, not by the file name.
+
+#define POINTS_MAGIC "KMPOINT1"
+#define POINTS_HEADER 16
+// Text files smaller than this are parsed by one thread.
+#define POINTS_PARALLEL_MIN (1 << 20)
+#define POINTS_STREAM_BLOCK (1 << 20)
+// Longest number handed to strtod when the fast path cannot be used.
+#define POINTS_TOKEN_MAX 128
+
+static const double points_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline int points_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Parses the number in [p, end), which must be a whole token. Decimal numbers
+// with at most 19 significant digits whose value is an integer below 2^53
+// times or divided by an exact power of ten (10^0..10^22) are converted with
+// one correctly rounded multiply or divide (Clinger's fast path); everything
+// else, including "inf", "nan" and hex floats, goes through strtod. Both give
+// the correctly rounded double, so the result is the same as fscanf's.
+// Returns 0, or -1 if the token is not a number.
+static inline int parse_double(const char* p, const char* end, double* out) {
+    const char* token = p;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0, any = 0, exact = 1;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, any = 1) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        } else {
+            exact = 0;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, any = 1) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                exponent--;
+            } else {
+                exact = 0;
+            }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E') && any) {
+        const char* q = p + 1;
+        int exp_negative = 0, value = 0;
+        if (q < end && (*q == '-' || *q == '+')) {
+            exp_negative = *q == '-';
+            q++;
+        }
+        if (q < end && *q >= '0' && *q <= '9') {
+            for (; q < end && *q >= '0' && *q <= '9'; q++) {
+                if (value < 10000) {
+                    value = value * 10 + (*q - '0');
+                }
+            }
+            exponent += exp_negative ? -value : value;
+            p = q;
+        }
+    }
+
+    if (any && p == end && exact && mantissa < (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+        double value = (double)mantissa;
+        value = exponent < 0 ? value / points_pow10[-exponent] : value * points_pow10[exponent];
+        *out = negative ? -value : value;
+        return 0;
+    }
+
+    char buf[POINTS_TOKEN_MAX];
+    size_t len = end - token;
+    if (len == 0 || len >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, token, len);
+    buf[len] = '\0';
+    char* stop;
+    *out = strtod(buf, &stop);
+    return stop == buf + len ? 0 : -1;
+}
+
+// Parses "x y" pairs from [p, end) into xs/ys starting at *count, growing
+// the arrays as needed. Returns 0; -1 on a malformed number or a final x
+// without its y (*count is then the index of the bad point); -2 when out of
+// memory.
+static inline int parse_points(const char* p, const char* end, double** xs, double** ys,
+                               long* count, long* capacity) {
+    int have_x = 0;
+    double x = 0;
+    while (p < end) {
+        while (p < end && points_space(*p)) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+        const char* token = p;
+        while (p < end && !points_space(*p)) {
+            p++;
+        }
+        double value;
+        if (parse_double(token, p, &value) != 0) {
+            return -1;
+        }
+        if (!have_x) {
+            x = value;
+            have_x = 1;
+            continue;
+        }
+        if (*count == *capacity) {
+            long grown = *capacity ? *capacity * 2 : 4096;
+            double* grown_x = realloc(*xs, grown * sizeof(double));
+            if (grown_x != NULL) *xs = grown_x;
+            double* grown_y = realloc(*ys, grown * sizeof(double));
+            if (grown_y != NULL) *ys = grown_y;
+            if (grown_x == NULL || grown_y == NULL) {
+                return -2;
+            }
+            *capacity = grown;
+        }
+        (*xs)[*count] = x;
+        (*ys)[*count] = value;
+        (*count)++;
+        have_x = 0;
+    }
+    return have_x ? -1 : 0;
+}
+
+// Points held in memory: either parsed into malloc'ed arrays or, for binary
+// files, pointing straight into the mapping.
+typedef struct {
+    double* xs;
+    double* ys;
+    long count;
+    int binary;
+    void* map;
+    size_t map_size;
+    long error_at;  // index of the bad point after a parse error
+} Point_set;
+
+typedef struct {
+    const char* begin;
+    const char* end;
+    double* xs;
+    double* ys;
+    long count;
+    long capacity;
+    int status;
+} Parse_chunk;
+
+static inline void* parse_chunk(void* arg) {
+    Parse_chunk* chunk = (Parse_chunk*)arg;
+    chunk->status = parse_points(chunk->begin, chunk->end, &chunk->xs, &chunk->ys,
+                                 &chunk->count, &chunk->capacity);
+    return NULL;
+}
+
+static inline int points_is_binary(const char* data, size_t size) {
+    return size >= POINTS_HEADER && memcmp(data, POINTS_MAGIC, 8) == 0;
+}
+
+// Loads a whole point file. Text files are mapped, cut into one piece per
+// thread at line boundaries and parsed in parallel; the pieces are then
+// copied together in file order. Binary files are only mapped.
+// Returns 0; -1 with errno set if the file cannot be opened or mapped; -2 on
+// a malformed file (set->error_at says where); -3 when out of memory.
+static inline int points_load(const char* path, int threads, Point_set* set) {
+    memset(set, 0, sizeof(*set));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+    char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+
+    if (points_is_binary(data, size)) {
+        uint64_t count;
+        memcpy(&count, data + 8, sizeof(count));
+        if (count > (size - POINTS_HEADER) / (2 * sizeof(double)) ||
+            size != POINTS_HEADER + count * 2 * sizeof(double)) {
+            munmap(data, size);
+            return -2;
+        }
+        set->binary = 1;
+        set->map = data;
+        set->map_size = size;
+        set->count = count;
+        set->xs = (double*)(data + POINTS_HEADER);
+        set->ys = set->xs + count;
+        return 0;
+    }
+
+    madvise(data, size, MADV_SEQUENTIAL);
+    if (threads < 1 || size < POINTS_PARALLEL_MIN) {
+        threads = 1;
+    }
+    Parse_chunk chunks[threads];
+    pthread_t ids[threads];
+    memset(chunks, 0, sizeof(chunks));
+    const char* pos = data;
+    for (int t = 0; t < threads; t++) {
+        const char* stop = data + size * (t + 1) / threads;
+        if (stop < pos) {
+            stop = pos;
+        }
+        const char* newline = stop < data + size ? memchr(stop, '\n', data + size - stop) : NULL;
+        stop = newline != NULL ? newline + 1 : data + size;
+        chunks[t].begin = pos;
+        chunks[t].end = t == threads - 1 ? data + size : stop;
+        pos = chunks[t].end;
+    }
+
+    int started = 1;
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&ids[t], NULL, parse_chunk, &chunks[t]) != 0) {
+            break;
+        }
+        started++;
+    }
+    for (int t = started; t < threads; t++) {
+        parse_chunk(&chunks[t]);
+    }
+    parse_chunk(&chunks[0]);
+    for (int t = 1; t < started; t++) {
+        pthread_join(ids[t], NULL);
+    }
+    munmap(data, size);
+
+    int status = 0;
+    long total = 0;
+    for (int t = 0; t < threads && status == 0; t++) {
+        if (chunks[t].status != 0) {
+            status = chunks[t].status == -1 ? -2 : -3;
+            set->error_at = total + chunks[t].count;
+        }
+        total += chunks[t].count;
+    }
+    if (status == 0 && threads == 1) {
+        set->xs = chunks[0].xs;
+        set->ys = chunks[0].ys;
+        set->count = total;
+        return 0;
+    }
+    if (status == 0 && total > 0) {
+        set->xs = malloc(total * sizeof(double));
+        set->ys = malloc(total * sizeof(double));
+        if (set->xs == NULL || set->ys == NULL) {
+            status = -3;
+        }
+    }
+    long offset = 0;
+    for (int t = 0; t < threads; t++) {
+        if (status == 0) {
+            memcpy(set->xs + offset, chunks[t].xs, chunks[t].count * sizeof(double));
+            memcpy(set->ys + offset, chunks[t].ys, chunks[t].count * sizeof(double));
+            offset += chunks[t].count;
+        }
+        free(chunks[t].xs);
+        free(chunks[t].ys);
+    }
+    if (status != 0) {
+        free(set->xs);
+        free(set->ys);
+        set->xs = set->ys = NULL;
+        return status;
+    }
+    set->count = total;
+    return 0;
+}
+
+static inline void points_free(Point_set* set) {
+    if (set->map != NULL) {
+        munmap(set->map, set->map_size);
+    } else {
+        free(set->xs);
+        free(set->ys);
+    }
+    memset(set, 0, sizeof(*set));
+}
+
+static inline int points_write_binary(const char* path, const double* xs, const double* ys, long count) {
+    FILE* out = fopen(path, "wb");
+    if (out == NULL) {
+        return -1;
+    }
+    uint64_t n = count;
+    int ok = fwrite(POINTS_MAGIC, 1, 8, out) == 8 &&
+             fwrite(&n, sizeof(n), 1, out) == 1 &&
+             fwrite(xs, sizeof(double), count, out) == (size_t)count &&
+             fwrite(ys, sizeof(double), count, out) == (size_t)count;
+    return fclose(out) == 0 && ok ? 0 : -1;
+}
+
+// %.17g prints every double so that it reads back as the same value.
+static inline int points_write_text(const char* path, const double* xs, const double* ys, long count) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    for (long i = 0; i < count; i++) {
+        fprintf(out, "%.17g %.17g\n", xs[i], ys[i]);
+    }
+    return fclose(out);
+}
+
+// Sequential reader for mini-batch mode: text is read a block at a time and
+// parsed with parse_double, binary files with pread from the x and y arrays.
+// Only one block is ever held in memory.
+typedef struct {
+    int fd;
+    int binary;
+    long total;         // binary: points in the file
+    long count;         // points returned since the last rewind
+    int error;          // set on a malformed file
+    char* buf;
+    size_t len, pos;
+    int eof;
+} Point_stream;
+
+static inline int stream_open(Point_stream* s, const char* path) {
+    memset(s, 0, sizeof(*s));
+    s->fd = open(path, O_RDONLY);
+    if (s->fd == -1) {
+        return -1;
+    }
+    char header[POINTS_HEADER];
+    ssize_t n = pread(s->fd, header, sizeof(header), 0);
+    if (n == POINTS_HEADER && points_is_binary(header, n)) {
+        uint64_t count;
+        memcpy(&count, header + 8, sizeof(count));
+        s->binary = 1;
+        s->total = count;
+        return 0;
+    }
+    s->buf = malloc(POINTS_STREAM_BLOCK);
+    if (s->buf == NULL) {
+        close(s->fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void stream_rewind(Point_stream* s) {
+    s->count = 0;
+    s->len = s->pos = 0;
+    s->eof = 0;
+    lseek(s->fd, 0, SEEK_SET);
+}
+
+static inline void stream_close(Point_stream* s) {
+    close(s->fd);
+    free(s->buf);
+}
+
+// Moves the unparsed tail to the front and reads more after it.
+static inline void stream_fill(Point_stream* s) {
+    memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+    s->len -= s->pos;
+    s->pos = 0;
+    while (s->len < POINTS_STREAM_BLOCK) {
+        ssize_t n = read(s->fd, s->buf + s->len, POINTS_STREAM_BLOCK - s->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            s->eof = 1;
+            break;
+        }
+        s->len += n;
+    }
+}
+
+// Next whole token in the buffer, refilling as needed; returns 0 at the end
+// of the file.
+static inline int stream_token(Point_stream* s, const char** begin, const char** end) {
+    for (;;) {
+        while (s->pos < s->len && points_space(s->buf[s->pos])) {
+            s->pos++;
+        }
+        size_t stop = s->pos;
+        while (stop < s->len && !points_space(s->buf[stop])) {
+            stop++;
+        }
+        if (stop < s->len || (s->eof && stop > s->pos)) {
+            *begin = s->buf + s->pos;
+            *end = s->buf + stop;
+            s->pos = stop;
+            return 1;
+        }
+        if (s->eof) {
+            return 0;
+        }
+        if (s->pos == 0 && s->len == POINTS_STREAM_BLOCK) {
+            // A single token filling the whole block cannot be a number.
+            s->error = 1;
+            return 0;
+        }
+        stream_fill(s);
+    }
+}
+
+// Reads up to max points; returns how many, 0 at the end of the file or on
+// an error (s->error is then set).
+static inline int stream_read(Point_stream* s, double* xs, double* ys, int max) {
+    if (s->binary) {
+        long n = s->total - s->count < max ? s->total - s->count : max;
+        size_t bytes = n * sizeof(double);
+        off_t x_at = POINTS_HEADER + s->count * sizeof(double);
+        off_t y_at = x_at + s->total * sizeof(double);
+        if (n > 0 && (pread(s->fd, xs, bytes, x_at) != (ssize_t)bytes ||
+                      pread(s->fd, ys, bytes, y_at) != (ssize_t)bytes)) {
+            s->error = 1;
+            return 0;
+        }
+        s->count += n;
+        return n;
+    }
+
+    int n = 0;
+    const char* begin;
+    const char* end;
+    while (n < max && !s->error && stream_token(s, &begin, &end)) {
+        if (parse_double(begin, end, &xs[n]) != 0 ||
+            !stream_token(s, &begin, &end) || parse_double(begin, end, &ys[n]) != 0) {
+            s->error = 1;
+            break;
+        }
+        n++;
+        s->count++;
+    }
+    return s->error ? 0 : n;
+}
+
+#endif
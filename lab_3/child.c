@@ -5,20 +5,122 @@
 #include <sys/mman.h>
 #include <semaphore.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "shared.h"
+#include "../lab_1/parser.h"
 
-#define SHM_NAME "/shared_memory"
-#define SEM_WRITE "/sem_write"
-#define SEM_READ "/sem_read"
-#define BUF_SIZE 256
+#define OUT_BLOCK (64 * 1024)
+// Longest line write_sum can produce.
+#define OUT_LINE_MAX sizeof("Sum in line -2147483648 = -2147483648\n")
+
+// Result lines are collected in an output block and written once it is full,
+// before anything goes to stderr, and at the end. In pool mode the block is
+// the batch's result slot instead, which the parent prints in order: text
+// goes into the open stdout segment, whose header is at segment_start, and
+// error messages get segments of their own (see Work_pool).
+char stdout_block[OUT_BLOCK];
+char *out_buf = stdout_block;
+size_t out_cap = OUT_BLOCK;
+size_t out_len = 0;
+size_t segment_start = 0;
+// The pool and batch being worked on, for writing out a full slot.
+Work_pool *slot_pool = NULL;
+uint64_t slot_batch = 0;
+int slot_spin_limit = 0;
+
+void open_slot(char *data, size_t capacity) {
+    out_buf = data;
+    out_cap = capacity;
+    segment_start = 0;
+    out_len = sizeof(uint32_t);
+}
+
+void close_segment(void) {
+    uint32_t len = out_len - segment_start - sizeof(uint32_t);
+    if (len == 0) {
+        return;
+    }
+    memcpy(out_buf + segment_start, &len, sizeof(len));
+    segment_start = out_len;
+    out_len += sizeof(uint32_t);
+}
+
+// Length of the slot's closed segments.
+size_t close_slot(void) {
+    close_segment();
+    return segment_start;
+}
+
+// The slot is full: once the parent has written every earlier batch, this
+// one is next in line, so its text so far can go out directly.
+void write_slot(void) {
+    size_t length = close_slot();
+    for (;;) {
+        uint64_t seen = atomic_load(&slot_pool->written);
+        if (seen == slot_batch) {
+            break;
+        }
+        pool_wait_change(slot_spin_limit, &slot_pool->written, seen, &slot_pool->printed, NULL);
+    }
+    struct iovec iov[16];
+    int count = write_segments(out_buf, length, iov, 0, 16);
+    writev_all(STDOUT_FILENO, iov, count);
+    open_slot(out_buf, out_cap);
+}
+
+void flush_output(void) {
+    if (out_buf != stdout_block) {
+        write_slot();
+        return;
+    }
+    write_all(STDOUT_FILENO, out_buf, out_len);
+    out_len = 0;
+}
+
+void write_error_len(const char *msg, size_t len) {
+    if (out_buf == stdout_block) {
+        flush_output();
+        write(STDERR_FILENO, msg, len);
+        return;
+    }
+    close_segment();
+    if (out_len + len > out_cap) {
+        write_slot();
+    }
+    uint32_t header = len | SEGMENT_ERROR;
+    memcpy(out_buf + segment_start, &header, sizeof(header));
+    memcpy(out_buf + out_len, msg, len);
+    segment_start = out_len + len;
+    out_len = segment_start + sizeof(uint32_t);
+}
 
 void write_error(const char *msg) {
-    write(STDERR_FILENO, msg, strlen(msg));
+    write_error_len(msg, strlen(msg));
 }
 
-void write_message(const char *msg, int line, int sum) {
-    char buffer[BUF_SIZE];
-    int len = snprintf(buffer, BUF_SIZE, msg, line, sum);
-    write(STDOUT_FILENO, buffer, len);
+void write_sum(int line, int sum) {
+    if (out_len + OUT_LINE_MAX > out_cap) {
+        flush_output();
+    }
+    char *p = out_buf + out_len;
+    memcpy(p, "Sum in line ", 12);
+    p = format_int(p + 12, line);
+    memcpy(p, " = ", 3);
+    p = format_int(p + 3, sum);
+    *p++ = '\n';
+    out_len = p - out_buf;
+}
+
+void write_header(const char *path) {
+    size_t len = strlen(path);
+    if (out_len + len + 9 > out_cap) {
+        flush_output();
+    }
+    memcpy(out_buf + out_len, "==> ", 4);
+    memcpy(out_buf + out_len + 4, path, len);
+    memcpy(out_buf + out_len + 4 + len, " <==\n", 5);
+    out_len += len + 9;
 }
 
 int str_to_int(const char *str, int *num) {
@@ -31,81 +133,247 @@ int str_to_int(const char *str, int *num) {
     return 1;
 }
 
-void remove_carriage_return(char *str) {
-    char *pos;
-    if ((pos = strchr(str, '\n')) != NULL) {
-        *pos = '\0';
+// Parses one line in place without modifying it, so the same code works on
+// ring records and on the read-only input mapping. The line ends at the first
+// '\n' or '\r'; tokens are separated by spaces.
+void process_line(const char *str, size_t len, int line) {
+    const char *end = str + len;
+    const char *cut;
+    if ((cut = memchr(str, '\n', end - str)) != NULL) {
+        end = cut;
+    }
+    if ((cut = memchr(str, '\r', end - str)) != NULL) {
+        end = cut;
+    }
+
+    int line_sum = 0;
+    int valid_line = 1;
+    char small[BUF_SIZE];
+    const char *p = str;
+
+    while (p < end) {
+        if (*p == ' ') {
+            p++;
+            continue;
+        }
+        const char *stop = memchr(p, ' ', end - p);
+        if (stop == NULL) {
+            stop = end;
+        }
+        size_t token_len = stop - p;
+        char *token = token_len < BUF_SIZE ? small : malloc(token_len + 1);
+        memcpy(token, p, token_len);
+        token[token_len] = '\0';
+
+        int num;
+        if (!str_to_int(token, &num)) {
+            char err_buf[BUF_SIZE];
+            int len = snprintf(err_buf, BUF_SIZE, "Invalid number in line %d: %s\n", line, token);
+            if (len >= BUF_SIZE) {
+                len = BUF_SIZE - 1;
+                err_buf[len - 1] = '\n';
+            }
+            write_error_len(err_buf, len);
+            valid_line = 0;
+        } else {
+            line_sum += num;
+        }
+
+        if (token != small) {
+            free(token);
+        }
+        p = stop;
+    }
+
+    if (valid_line) {
+        write_sum(line, line_sum);
+    }
+}
+
+// Zero-copy mode: the record only names a byte range of the input file, which
+// is mapped here once. Returns the next line number.
+int process_chunk(const char *input, const Chunk *chunk, int line) {
+    const char *p = input + chunk->offset;
+    const char *end = p + chunk->length;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *next = nl != NULL ? nl + 1 : end;
+        process_line(p, next - p, line++);
+        p = next;
     }
-    if ((pos = strchr(str, '\r')) != NULL) {
-        *pos = '\0';
+    return line;
+}
+
+// Pool worker: keeps the file of the job it last worked on mapped and only
+// remaps when a batch of another job comes in.
+void run_pool_worker(Work_pool *pool, int spin_limit) {
+    slot_pool = pool;
+    slot_spin_limit = spin_limit;
+    Batch batch;
+    Mapped_file file = {NULL, 0};
+    uint64_t mapped_job = UINT64_MAX;
+    int map_failed = 0;
+
+    for (;;) {
+        uint64_t seen = atomic_load(&pool->published);
+        if (pool_pop(pool, &batch)) {
+            Result_slot *slot = &pool->slots[batch.id % POOL_SLOTS];
+            const char *path = pool->job_paths[batch.job % POOL_SLOTS];
+            open_slot(slot->data, RESULT_SIZE);
+            slot_batch = batch.id;
+            // Errors from here on go into the slot, in batch order.
+            if (batch.job != mapped_job) {
+                unmap_file(&file);
+                mapped_job = batch.job;
+                map_failed = map_file(path, &file) == -1;
+                if (map_failed) {
+                    write_error("Error mapping input file\n");
+                }
+            }
+            slot->failed = map_failed;
+            if (batch.flags & BATCH_HEADER) {
+                write_header(path);
+            }
+            if (batch.offset + batch.length <= file.size) {
+                Chunk chunk = {batch.offset, batch.length};
+                process_chunk(file.data, &chunk, batch.first_line);
+            }
+            slot->length = close_slot();
+            out_buf = stdout_block;
+            out_cap = OUT_BLOCK;
+            out_len = 0;
+            atomic_store(&slot->ready, batch.id + 1);
+            atomic_fetch_add(&pool->completed, 1);
+            pool_wake_all(&pool->results);
+            continue;
+        }
+        if (atomic_load(&pool->shutdown)) {
+            break;
+        }
+        pool_wait_change(spin_limit, &pool->published, seen, &pool->work, NULL);
     }
+
+    unmap_file(&file);
 }
 
-int main() {
-    int shm_fd = shm_open(SHM_NAME, O_RDWR, 0666);
+int main(int argc, char *argv[]) {
+    Session_names names;
+    session_names(&names, argc > 1 ? argv[1] : NULL);
+
+    int shm_fd = shm_open(names.shm, O_RDWR, 0666);
     if (shm_fd == -1) {
         write_error("Error opening shared memory\n");
         exit(EXIT_FAILURE);
     }
 
-    char *shm_ptr = mmap(0, BUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (shm_ptr == MAP_FAILED) {
-        write_error("Error mapping shared memory\n");
+    struct stat shm_st;
+    if (fstat(shm_fd, &shm_st) == -1) {
+        write_error("Error opening shared memory\n");
         exit(EXIT_FAILURE);
     }
+    size_t shm_size = shm_st.st_size;
 
-    sem_t *sem_write = sem_open(SEM_WRITE, 0);
-    sem_t *sem_read = sem_open(SEM_READ, 0);
-    if (sem_write == SEM_FAILED || sem_read == SEM_FAILED) {
-        write_error("Error opening semaphores\n");
+    Ring ring = {0};
+    ring.shm = mmap(0, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (ring.shm == MAP_FAILED) {
+        write_error("Error mapping shared memory\n");
         exit(EXIT_FAILURE);
     }
+    close(shm_fd);
 
+    if (ring.shm->sync_mode == SYNC_SEM && !ring.shm->pool_workers) {
+        ring.space = sem_open(names.sem_write, 0);
+        ring.items = sem_open(names.sem_read, 0);
+        if (ring.space == SEM_FAILED || ring.items == SEM_FAILED) {
+            write_error("Error opening semaphores\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (ring.shm->pool_workers) {
+        run_pool_worker(pool_of(ring.shm), ring.shm->spin_limit);
+        munmap(ring.shm, shm_size);
+        return 0;
+    }
+
+    Mapped_file input = {NULL, 0};
     int line = 1;
+    // A job whose file cannot be mapped has no output, so it fails the run.
+    int status = 0;
+    // Only lines that arrive in several pieces are assembled here; everything
+    // else is parsed directly in the ring.
+    char *long_line = NULL;
+    size_t long_len = 0;
 
     while (1) {
-        sem_wait(sem_read);
+        // Nothing to parse right now: let the sums so far out, so a parent
+        // that reads file names from stdin shows each file's results without
+        // waiting for the next name.
+        if (out_len > 0 && atomic_load(&ring.shm->head) == atomic_load(&ring.shm->tail)) {
+            flush_output();
+        }
+        uint32_t flags, len;
+        char *record = ring_peek(&ring, &flags, &len);
 
-        if (shm_ptr[0] == '\0') {
+        if (flags & REC_END) {
+            ring_release(&ring, len);
             break;
         }
 
-        remove_carriage_return(shm_ptr);
-
-        char buffer[BUF_SIZE];
-        strncpy(buffer, shm_ptr, BUF_SIZE);
-        buffer[BUF_SIZE - 1] = '\0';
-
-        char *token = strtok(buffer, " ");
-        int line_sum = 0;
-        int valid_line = 1;
-
-        while (token != NULL) {
-            int num;
-            if (!str_to_int(token, &num)) {
-                char err_buf[BUF_SIZE];
-                int len = snprintf(err_buf, BUF_SIZE, "Invalid number in line %d: %s\n", line, token);
-                write(STDERR_FILENO, err_buf, len);
-                valid_line = 0;
-            } else {
-                line_sum += num;
+        if (flags & REC_JOB) {
+            uint32_t job_flags;
+            memcpy(&job_flags, record, sizeof(job_flags));
+            const char *path = record + sizeof(job_flags);
+            unmap_file(&input);
+            if ((job_flags & JOB_MAPPED) && map_file(path, &input) == -1) {
+                write_error("Error mapping input file\n");
+                status = EXIT_FAILURE;
+            }
+            if (job_flags & JOB_HEADER) {
+                write_header(path);
+            }
+            ring_release(&ring, len);
+            line = 1;
+            continue;
+        }
+
+        if (flags & REC_CHUNK) {
+            Chunk chunk;
+            memcpy(&chunk, record, sizeof(chunk));
+            ring_release(&ring, len);
+            if (chunk.offset + chunk.length <= input.size) {
+                line = process_chunk(input.data, &chunk, line);
             }
-            token = strtok(NULL, " ");
+            continue;
         }
 
-        if (valid_line) {
-            write_message("Sum in line %d = %d\n", line, line_sum);
+        if ((flags & REC_MORE) || long_len > 0) {
+            long_line = realloc(long_line, long_len + len);
+            memcpy(long_line + long_len, record, len);
+            long_len += len;
+            ring_release(&ring, len);
+            if (flags & REC_MORE) {
+                continue;
+            }
+            process_line(long_line, long_len, line);
+            long_len = 0;
+        } else {
+            process_line(record, len, line);
+            ring_release(&ring, len);
         }
 
         line++;
-        sem_post(sem_write);
     }
 
-    munmap(shm_ptr, BUF_SIZE);
-    sem_close(sem_write);
-    sem_close(sem_read);
-    sem_unlink(SEM_WRITE);
-    sem_unlink(SEM_READ);
+    flush_output();
+    free(long_line);
+    unmap_file(&input);
+    if (ring.space != NULL) {
+        sem_close(ring.space);
+        sem_close(ring.items);
+    }
+    munmap(ring.shm, shm_size);
 
-    return 0;
+    return status;
 }
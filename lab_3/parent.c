@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,76 +6,447 @@
 #include <sys/mman.h>
 #include <semaphore.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
-#define SHM_NAME "/shared_memory"
-#define SEM_WRITE "/sem_write"
-#define SEM_READ "/sem_read"
-#define BUF_SIZE 256
+#include <signal.h>
+#include <poll.h>
+#include "shared.h"
+#define DEFAULT_SPIN 1000
+#define CHUNK_BYTES (256 * 1024)
+// How long the parent parks on the pool before it checks on the workers.
+#define REAP_INTERVAL_NS 50000000
 void write_error(const char *msg) {
     write(STDERR_FILENO, msg, strlen(msg));
 }
+void usage(void) {
+    const char msg[] = "Usage: ./parent [-z] [-j workers] [-m futex|sem] [-s spins] [-S session] [-v] <filename>... | -\n"
+                       "With -, file names are read from stdin, one per line, until EOF.\n";
+    write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    exit(EXIT_FAILURE);
+}
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+// Sends one line (with its '\n', if any). Long lines are split into REC_MORE
+// pieces.
+void send_line(const Ring *ring, const char *line, size_t len) {
+    while (len > RECORD_MAX) {
+        ring_put(ring, REC_MORE, line, RECORD_MAX);
+        line += RECORD_MAX;
+        len -= RECORD_MAX;
+    }
+    ring_put(ring, 0, line, len);
+}
+// -z: the child maps the file itself, so only (offset, length) pairs covering
+// whole lines go through the ring. Returns the number of chunks sent.
+unsigned long send_chunks(const Ring *ring, const char *input, size_t size) {
+    unsigned long chunks = 0;
+    size_t offset = 0;
+    while (offset < size) {
+        size_t end = offset + CHUNK_BYTES;
+        if (end >= size) {
+            end = size;
+        } else {
+            const char *nl = memchr(input + end - 1, '\n', size - end + 1);
+            end = nl != NULL ? (size_t)(nl - input) + 1 : size;
+        }
+        Chunk chunk = {offset, end - offset};
+        ring_put(ring, REC_CHUNK, (const char *)&chunk, sizeof(chunk));
+        offset = end;
+        chunks++;
+    }
+    return chunks;
+}
+// Cuts the next batch starting at offset: whole lines, at most BATCH_LINES of
+// them and roughly BATCH_BYTES. Returns the batch end and the line count.
+size_t next_batch(const char *input, size_t size, size_t offset, uint64_t *lines) {
+    size_t end = offset;
+    *lines = 0;
+    while (end < size && *lines < BATCH_LINES && end - offset < BATCH_BYTES) {
+        const char *nl = memchr(input + end, '\n', size - end);
+        end = nl != NULL ? (size_t)(nl - input) + 1 : size;
+        (*lines)++;
+    }
+    return end;
+}
+// -j: parent side of the pool. Up to POOL_SLOTS batches are in flight and
+// finished results are written strictly in batch order.
+//
+// Workers only exit once the pool shuts down. One that is gone before that,
+// because it crashed or could not be started, may have taken a batch that now
+// never finishes, so the pool is given up: failed is set, the waits below
+// return and nothing more is submitted.
+typedef struct {
+    Work_pool *pool;
+    int spin_limit;
+    uint64_t next_id;
+    uint64_t collect_id;
+    pid_t *pids;
+    int workers;
+    // Workers not reaped yet.
+    int live;
+    int failed;
+    // Set once a worker could not read a job's file.
+    int job_failed;
+} Pool_client;
+// Reaps the workers that have exited without blocking.
+void pool_reap(Pool_client *client) {
+    pid_t pid;
+    while (client->live > 0 && (pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (int i = 0; i < client->workers; i++) {
+            if (client->pids[i] == pid) {
+                client->pids[i] = 0;
+                client->live--;
+                client->failed = 1;
+            }
+        }
+    }
+}
+// Stops the workers that are left after a failure and waits for them.
+void pool_abort(Pool_client *client) {
+    write_error("Error: a worker process exited early\n");
+    for (int i = 0; i < client->workers; i++) {
+        if (client->pids[i] > 0) {
+            kill(client->pids[i], SIGTERM);
+        }
+    }
+    while (client->live > 0 && wait(NULL) > 0) {
+        client->live--;
+    }
+}
+// Waits for the oldest batch in flight, then also takes every later batch that
+// is already finished, and writes them all, stdout text with one writev()
+// between error messages. Returns -1 if the pool failed first.
+int pool_collect_one(Pool_client *client) {
+    static const struct timespec reap_interval = {0, REAP_INTERVAL_NS};
+    Work_pool *pool = client->pool;
+    Result_slot *slot = &pool->slots[client->collect_id % POOL_SLOTS];
+    for (;;) {
+        uint64_t seen = atomic_load(&pool->completed);
+        if (atomic_load(&slot->ready) == client->collect_id + 1) {
+            break;
+        }
+        pool_reap(client);
+        if (client->failed) {
+            return -1;
+        }
+        pool_wait_change(client->spin_limit, &pool->completed, seen, &pool->results, &reap_interval);
+    }
+
+    struct iovec iov[POOL_SLOTS];
+    int count = 0;
+    while (client->collect_id < client->next_id) {
+        slot = &pool->slots[client->collect_id % POOL_SLOTS];
+        if (atomic_load(&slot->ready) != client->collect_id + 1) {
+            break;
+        }
+        count = write_segments(slot->data, slot->length, iov, count, POOL_SLOTS);
+        client->job_failed |= slot->failed;
+        client->collect_id++;
+    }
+    writev_all(STDOUT_FILENO, iov, count);
+    atomic_store(&pool->written, client->collect_id);
+    pool_wake_all(&pool->printed);
+    return 0;
+}
+// Publishes one job as batches; an empty file still gets one (empty) batch so
+// its header comes out in order. Returns the number of batches, which falls
+// short if the pool fails.
+unsigned long pool_submit_job(Pool_client *client, uint64_t job, const char *path,
+                              const Mapped_file *file, int header) {
+    Work_pool *pool = client->pool;
+    unsigned long batches = 0;
+    uint64_t line = 1;
+    size_t offset = 0;
+    do {
+        uint64_t lines;
+        size_t end = next_batch(file->data, file->size, offset, &lines);
+        while (client->next_id - client->collect_id >= POOL_SLOTS) {
+            if (pool_collect_one(client) == -1) {
+                return batches;
+            }
+        }
+        if (batches == 0) {
+            strcpy(pool->job_paths[job % POOL_SLOTS], path);
+        }
+        Batch batch = {client->next_id, job, batches == 0 && header ? BATCH_HEADER : 0,
+                       offset, end - offset, line};
+        // The queue has a cell per slot, so with fewer than POOL_SLOTS
+        // batches in flight it has room; should it not, wait for the oldest.
+        while (!pool_push(pool, &batch)) {
+            if (pool_collect_one(client) == -1) {
+                return batches;
+            }
+        }
+        client->next_id++;
+        atomic_fetch_add(&pool->published, 1);
+        pool_wake_all(&pool->work);
+        offset = end;
+        line += lines;
+        batches++;
+    } while (offset < file->size);
+    return batches;
+}
+// Waits for and writes out every batch in flight.
+void pool_drain(Pool_client *client) {
+    while (!client->failed && client->collect_id < client->next_id) {
+        pool_collect_one(client);
+    }
+}
+// Collects what is left, shuts the pool down and waits for the workers.
+// Returns -1 if the pool failed, after stopping the remaining workers.
+int pool_finish(Pool_client *client) {
+    pool_drain(client);
+    if (client->failed) {
+        pool_abort(client);
+        return -1;
+    }
+    atomic_store(&client->pool->shutdown, 1);
+    atomic_fetch_add(&client->pool->published, 1);
+    pool_wake_all(&client->pool->work);
+    while (client->live > 0 && wait(NULL) > 0) {
+        client->live--;
+    }
+    return 0;
+}
+void send_job(const Ring *ring, uint32_t job_flags, const char *path) {
+    char record[sizeof(uint32_t) + PATH_MAX];
+    size_t len = strlen(path) + 1;
+    memcpy(record, &job_flags, sizeof(job_flags));
+    memcpy(record + sizeof(job_flags), path, len);
+    ring_put(ring, REC_JOB, record, sizeof(job_flags) + len);
+}
+// Whether reading stdin would block. With -, stdin is unbuffered, so no input
+// can be sitting in stdio's buffer where poll() does not see it.
+int stdin_idle(void) {
+    struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&fd, 1, 0) == 0;
+}
+// The next input file: the next argument, or with - the next non-empty line
+// of stdin. Returns NULL at the end of the list.
+const char *next_path(char **argv, int argc, int *next, int from_stdin, char **line, size_t *capacity) {
+    if (!from_stdin) {
+        return *next < argc ? argv[(*next)++] : NULL;
+    }
+    ssize_t len;
+    while ((len = getline(line, capacity, stdin)) != -1) {
+        if (len > 0 && (*line)[len - 1] == '\n') {
+            (*line)[--len] = '\0';
+        }
+        if (len > 0) {
+            return *line;
+        }
+    }
+    return NULL;
+}
+void print_wait_point(const char *name, Wait_point *wp) {
+    fprintf(stderr, "%s: spin hits %lu, spin loops %lu, parks %lu, wakeups %lu\n", name,
+            (unsigned long)atomic_load(&wp->spin_hits), (unsigned long)atomic_load(&wp->spin_loops),
+            (unsigned long)atomic_load(&wp->parks), (unsigned long)atomic_load(&wp->wakeups));
+}
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        const char msg[] = "Usage: ./parent <filename>\n";
-        write(STDERR_FILENO, msg, sizeof(msg) - 1);
-        exit(EXIT_FAILURE);
+    int sync_mode = SYNC_FUTEX;
+    // Spinning only helps when the other side runs on another CPU.
+    int spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? DEFAULT_SPIN : 0;
+    int verbose = 0;
+    int zero_copy = 0;
+    int workers = 1;
+    char session[SESSION_MAX];
+    snprintf(session, sizeof(session), "lab3_%d", (int)getpid());
+    int opt;
+    while ((opt = getopt(argc, argv, "zj:m:s:S:v")) != -1) {
+        if (opt == 'z') {
+            zero_copy = 1;
+        } else if (opt == 'j' && atoi(optarg) >= 1) {
+            workers = atoi(optarg);
+        } else if (opt == 'm' && strcmp(optarg, "futex") == 0) {
+            sync_mode = SYNC_FUTEX;
+        } else if (opt == 'm' && strcmp(optarg, "sem") == 0) {
+            sync_mode = SYNC_SEM;
+        } else if (opt == 's' && atoi(optarg) >= 0) {
+            spin_limit = atoi(optarg);
+        } else if (opt == 'S' && *optarg && !strchr(optarg, '/') && strlen(optarg) < SESSION_MAX) {
+            strcpy(session, optarg);
+        } else if (opt == 'v') {
+            verbose = 1;
+        } else {
+            usage();
+        }
     }
-    FILE *file = fopen(argv[1], "r");
-    if (!file) {
-        write_error("Error opening file\n");
-        exit(EXIT_FAILURE);
+    if (optind >= argc) {
+        usage();
     }
-    int shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
+    int num_files = argc - optind;
+    // A job service: files are taken from stdin as they come.
+    int from_stdin = num_files == 1 && strcmp(argv[optind], "-") == 0;
+    if (from_stdin) {
+        setvbuf(stdin, NULL, _IONBF, 0);
+    }
+    // Workers take batches by file offset, so the pool always maps the input.
+    if (workers > 1) {
+        zero_copy = 1;
+    }
+    Session_names names;
+    session_names(&names, session);
+    size_t shm_size = sizeof(Shared_ring) + (workers > 1 ? sizeof(Work_pool) : 0);
+    int shm_fd = shm_open(names.shm, O_CREAT | O_EXCL | O_RDWR, 0600);
     if (shm_fd == -1) {
         write_error("Error creating shared memory\n");
-        fclose(file);
         exit(EXIT_FAILURE);
     }
-    if (ftruncate(shm_fd, BUF_SIZE) == -1) {
+    if (ftruncate(shm_fd, shm_size) == -1) {
         write_error("Error setting shared memory size\n");
-        fclose(file);
-        shm_unlink(SHM_NAME);
+        shm_unlink(names.shm);
         exit(EXIT_FAILURE);
     }
-    char *shm_ptr = mmap(0, BUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd,
-                         0);
-    if (shm_ptr == MAP_FAILED) {
+    Ring ring = {0};
+    ring.shm = mmap(0, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (ring.shm == MAP_FAILED) {
         write_error("Error mapping shared memory\n");
-        fclose(file);
-        shm_unlink(SHM_NAME);
+        shm_unlink(names.shm);
         exit(EXIT_FAILURE);
     }
-    sem_t *sem_write = sem_open(SEM_WRITE, O_CREAT, 0666, 1);
-    sem_t *sem_read = sem_open(SEM_READ, O_CREAT, 0666, 0);
-    if (sem_write == SEM_FAILED || sem_read == SEM_FAILED) {
-        write_error("Error creating semaphores\n");
-        fclose(file);
-        shm_unlink(SHM_NAME);
-        exit(EXIT_FAILURE);
+    close(shm_fd);
+    memset(ring.shm, 0, offsetof(Shared_ring, data));
+    ring.shm->sync_mode = sync_mode;
+    ring.shm->spin_limit = spin_limit;
+    ring.shm->pool_workers = workers > 1 ? workers : 0;
+    if (workers > 1) {
+        pool_init(pool_of(ring.shm));
     }
-    pid_t pid = fork();
-    if (pid == 0) {
-        execl("./child", "./child", NULL);
-        write_error("Error executing child process\n");
-        exit(EXIT_FAILURE);
-    } else if (pid > 0) {
-        char buffer[BUF_SIZE];
-        while (fgets(buffer, sizeof(buffer), file) != NULL) {
-            sem_wait(sem_write);
-            strncpy(shm_ptr, buffer, BUF_SIZE);
-            sem_post(sem_read);
-        }
-        sem_wait(sem_write);
-        shm_ptr[0] = '\0';
-        sem_post(sem_read);
-        wait(NULL);
-        fclose(file);
-        munmap(shm_ptr, BUF_SIZE);
-        shm_unlink(SHM_NAME);
-        sem_close(sem_write);
-        sem_close(sem_read);
-        sem_unlink(SEM_WRITE);
-        sem_unlink(SEM_READ);
+    if (sync_mode == SYNC_SEM) {
+        sem_unlink(names.sem_write);
+        sem_unlink(names.sem_read);
+        ring.space = sem_open(names.sem_write, O_CREAT, 0600, 0);
+        ring.items = sem_open(names.sem_read, O_CREAT, 0600, 0);
+        if (ring.space == SEM_FAILED || ring.items == SEM_FAILED) {
+            write_error("Error creating semaphores\n");
+            shm_unlink(names.shm);
+            exit(EXIT_FAILURE);
+        }
     }
-    return 0;
-}
\ No newline at end of file
+    double start = now_seconds();
+    int children = 0;
+    pid_t *pids = calloc(workers, sizeof(pid_t));
+    while (children < workers) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execl("./child", "./child", session, NULL);
+            write_error("Error executing child process\n");
+            exit(EXIT_FAILURE);
+        } else if (pid < 0) {
+            write_error("Error creating child process\n");
+            break;
+        }
+        pids[children++] = pid;
+    }
+    int status = 0;
+    if (children > 0) {
+        // The children stay up for the whole list; each file is one job.
+        Pool_client client = {pool_of(ring.shm), spin_limit, 0, 0, pids, children, children, 0, 0};
+        // Only files that were opened become jobs, so every job number has
+        // at least one batch (see Work_pool).
+        uint64_t jobs = 0;
+        char *buffer = NULL;
+        size_t capacity = 0;
+        ssize_t len;
+        unsigned long records = 0;
+        const char *unit = workers > 1 ? "batch" : zero_copy ? "chunk" : "line";
+        char *path_line = NULL;
+        size_t path_capacity = 0;
+        int next_arg = optind;
+        int files = 0;
+        const char *path;
+        for (;;) {
+            // Before waiting for the next name, write out what is done.
+            if (from_stdin && workers > 1 && stdin_idle()) {
+                pool_drain(&client);
+            }
+            if (client.failed) {
+                break;
+            }
+            path = next_path(argv, argc, &next_arg, from_stdin, &path_line, &path_capacity);
+            if (path == NULL) {
+                break;
+            }
+            files++;
+            int header = from_stdin || num_files > 1;
+            if (strlen(path) >= PATH_MAX) {
+                write_error("Error opening file\n");
+                status = EXIT_FAILURE;
+                continue;
+            }
+            if (zero_copy) {
+                Mapped_file file;
+                if (map_file(path, &file) == -1) {
+                    write_error("Error opening file\n");
+                    status = EXIT_FAILURE;
+                    continue;
+                }
+                if (workers > 1) {
+                    records += pool_submit_job(&client, jobs++, path, &file, header);
+                } else {
+                    send_job(&ring, JOB_MAPPED | (header ? JOB_HEADER : 0), path);
+                    records += send_chunks(&ring, file.data, file.size);
+                }
+                unmap_file(&file);
+            } else {
+                FILE *file = fopen(path, "r");
+                if (!file) {
+                    write_error("Error opening file\n");
+                    status = EXIT_FAILURE;
+                    continue;
+                }
+                send_job(&ring, header ? JOB_HEADER : 0, path);
+                while ((len = getline(&buffer, &capacity, file)) != -1) {
+                    send_line(&ring, buffer, len);
+                    records++;
+                }
+                fclose(file);
+            }
+        }
+        if (workers > 1) {
+            if (pool_finish(&client) == -1 || client.job_failed) {
+                status = EXIT_FAILURE;
+            }
+        } else {
+            ring_put(&ring, REC_END, NULL, 0);
+            int child_status;
+            if (wait(&child_status) == -1 || !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0) {
+                status = EXIT_FAILURE;
+            }
+        }
+        double seconds = now_seconds() - start;
+        if (verbose) {
+            fprintf(stderr, "%d files, %lu records in %.3f s, %.1f ns/%s (%s, spin %d, session %s)\n",
+                    files, records, seconds, records ? seconds * 1e9 / records : 0.0, unit,
+                    sync_mode == SYNC_SEM ? "sem" : "futex", spin_limit, session);
+            if (workers > 1) {
+                print_wait_point("workers waiting for batches", &pool_of(ring.shm)->work);
+                print_wait_point("parent waiting for results", &pool_of(ring.shm)->results);
+            } else {
+                print_wait_point("producer waiting for space", &ring.shm->space);
+                print_wait_point("consumer waiting for lines", &ring.shm->items);
+            }
+        }
+        free(buffer);
+        free(path_line);
+    } else {
+        status = EXIT_FAILURE;
+    }
+    free(pids);
+    munmap(ring.shm, shm_size);
+    shm_unlink(names.shm);
+    if (sync_mode == SYNC_SEM) {
+        sem_close(ring.space);
+        sem_close(ring.items);
+        sem_unlink(names.sem_write);
+        sem_unlink(names.sem_read);
+    }
+    return status;
+}
@@ -0,0 +1,535 @@
+#ifndef LAB_3_SHARED_H
+#define LAB_3_SHARED_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define SHM_NAME "/shared_memory"
+#define SEM_WRITE "/sem_write"
+#define SEM_READ "/sem_read"
+#define BUF_SIZE 256
+
+// IPC object names of one parent/child session. The parent picks the session
+// (-S, default lab3_<pid>) and passes it to the child as argv[1]; a child
+// started without it falls back to the historical global names.
+#define SESSION_MAX 64
+
+typedef struct {
+    char shm[SESSION_MAX + 2];
+    char sem_write[SESSION_MAX + 8];
+    char sem_read[SESSION_MAX + 8];
+} Session_names;
+
+static inline void session_names(Session_names *names, const char *session)
+{
+    if (session == NULL) {
+        snprintf(names->shm, sizeof(names->shm), "%s", SHM_NAME);
+        snprintf(names->sem_write, sizeof(names->sem_write), "%s", SEM_WRITE);
+        snprintf(names->sem_read, sizeof(names->sem_read), "%s", SEM_READ);
+        return;
+    }
+    snprintf(names->shm, sizeof(names->shm), "/%s", session);
+    snprintf(names->sem_write, sizeof(names->sem_write), "/%s_write", session);
+    snprintf(names->sem_read, sizeof(names->sem_read), "/%s_read", session);
+}
+
+// The shared segment is a single-producer/single-consumer byte ring of
+// variable-length records. head and tail only grow; position = value % size.
+// Each record is a 4-byte header (length | flags) followed by the payload and
+// padded to 8 bytes. A line longer than RECORD_MAX is sent as several records
+// with REC_MORE set on all but the last one.
+#define RING_SIZE (1 << 20)
+#define RECORD_MAX (RING_SIZE / 4)
+
+// A full ring is only reported as writable again once it has drained below
+// this mark, so a blocked producer wakes up to a batch of free space instead
+// of one record's worth. It also covers the largest record plus wrap padding.
+#define RING_LOW_WATER (RING_SIZE / 2 - 64)
+
+#define REC_MORE 0x80000000u
+#define REC_WRAP 0x40000000u
+#define REC_END 0x20000000u
+#define REC_CHUNK 0x10000000u
+#define REC_JOB 0x08000000u
+
+// REC_JOB starts the next input file: a uint32_t of JOB_* flags followed by
+// the NUL-terminated path. Line numbers restart at 1 for every job.
+#define JOB_HEADER 1u
+#define JOB_MAPPED 2u
+#define REC_LEN_MASK 0x07FFFFFFu
+
+#define SYNC_FUTEX 0
+#define SYNC_SEM 1
+
+// One side's sleeping place. "seq" is the futex word and only changes when a
+// sleeper is woken; the counters are statistics for -v.
+typedef struct {
+    _Atomic uint32_t seq;
+    _Atomic int waiting;
+    _Atomic uint64_t spin_hits;
+    _Atomic uint64_t spin_loops;
+    _Atomic uint64_t parks;
+    _Atomic uint64_t wakeups;
+} Wait_point;
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t head;
+    Wait_point items;
+    _Alignas(64) _Atomic uint64_t tail;
+    Wait_point space;
+    _Alignas(64) int sync_mode;
+    int spin_limit;
+    int pool_workers;
+    _Alignas(64) char data[RING_SIZE];
+} Shared_ring;
+
+// Payload of a REC_CHUNK record (-z): whole lines of the current job's file,
+// which the child maps itself.
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} Chunk;
+
+// Process-local view of the ring: the mapping plus, in SYNC_SEM mode, the
+// named semaphores used to park.
+typedef struct {
+    Shared_ring *shm;
+    sem_t *space;
+    sem_t *items;
+} Ring;
+
+typedef struct {
+    const char *data;
+    size_t size;
+} Mapped_file;
+
+// Maps a whole file read-only; an empty file gives data == NULL.
+static inline int map_file(const char *path, Mapped_file *file)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    file->data = NULL;
+    file->size = st.st_size;
+    if (file->size > 0) {
+        void *data = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(data, file->size, MADV_SEQUENTIAL);
+        file->data = data;
+    }
+    close(fd);
+    return 0;
+}
+
+static inline void unmap_file(Mapped_file *file)
+{
+    if (file->data != NULL) {
+        munmap((void *)file->data, file->size);
+    }
+    file->data = NULL;
+    file->size = 0;
+}
+
+static inline uint32_t record_size(uint32_t len)
+{
+    return (4 + len + 7) & ~7u;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// A NULL timeout waits until woken.
+static inline void futex_wait_for(_Atomic uint32_t *word, uint32_t expected, const struct timespec *timeout)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT, expected, timeout, NULL, 0);
+}
+
+static inline void futex_wait(_Atomic uint32_t *word, uint32_t expected)
+{
+    futex_wait_for(word, expected, NULL);
+}
+
+static inline void futex_wake(_Atomic uint32_t *word, int count)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+static inline void park(const Ring *ring, Wait_point *wp, sem_t *sem, uint32_t seq)
+{
+    atomic_fetch_add_explicit(&wp->parks, 1, memory_order_relaxed);
+    if (ring->shm->sync_mode == SYNC_SEM) {
+        sem_wait(sem);
+    } else {
+        futex_wait(&wp->seq, seq);
+    }
+}
+
+// Waits until *counter differs from seen: first by spinning up to spin_limit
+// times, then by parking. The waiting flag is raised before the last check, so
+// the other side either sees it and wakes us, or we see its update; a stray
+// wakeup only costs one extra loop.
+static inline void ring_wait_change(const Ring *ring, _Atomic uint64_t *counter, uint64_t seen,
+                                    Wait_point *wp, sem_t *sem)
+{
+    int limit = ring->shm->spin_limit;
+    for (int i = 0; i < limit; i++) {
+        if (atomic_load_explicit(counter, memory_order_acquire) != seen) {
+            if (i > 0) {
+                atomic_fetch_add_explicit(&wp->spin_hits, 1, memory_order_relaxed);
+                atomic_fetch_add_explicit(&wp->spin_loops, i, memory_order_relaxed);
+            }
+            return;
+        }
+        cpu_relax();
+    }
+    if (limit > 0) {
+        atomic_fetch_add_explicit(&wp->spin_loops, limit, memory_order_relaxed);
+    }
+
+    while (atomic_load(counter) == seen) {
+        uint32_t seq = atomic_load(&wp->seq);
+        atomic_store(&wp->waiting, 1);
+        if (atomic_load(counter) != seen) {
+            atomic_store(&wp->waiting, 0);
+            break;
+        }
+        park(ring, wp, sem, seq);
+    }
+}
+
+static inline void ring_wake(const Ring *ring, Wait_point *wp, sem_t *sem)
+{
+    if (atomic_load(&wp->waiting) && atomic_exchange(&wp->waiting, 0)) {
+        atomic_fetch_add_explicit(&wp->wakeups, 1, memory_order_relaxed);
+        if (ring->shm->sync_mode == SYNC_SEM) {
+            sem_post(sem);
+        } else {
+            atomic_fetch_add(&wp->seq, 1);
+            futex_wake(&wp->seq, 1);
+        }
+    }
+}
+
+// Producer side. Blocks only while the ring has no room for the record.
+static inline void ring_put(const Ring *ring, uint32_t flags, const char *data, uint32_t len)
+{
+    Shared_ring *shm = ring->shm;
+    uint64_t head = atomic_load_explicit(&shm->head, memory_order_relaxed);
+    uint32_t need = record_size(len);
+    uint32_t pos = head % RING_SIZE;
+    uint32_t to_end = RING_SIZE - pos;
+    uint32_t total = need <= to_end ? need : to_end + need;
+
+    for (;;) {
+        uint64_t tail = atomic_load(&shm->tail);
+        if (RING_SIZE - (head - tail) >= total) {
+            break;
+        }
+        ring_wait_change(ring, &shm->tail, tail, &shm->space, ring->space);
+    }
+
+    if (need > to_end) {
+        uint32_t wrap = REC_WRAP;
+        memcpy(shm->data + pos, &wrap, sizeof(wrap));
+        head += to_end;
+        pos = 0;
+    }
+
+    uint32_t header = len | flags;
+    memcpy(shm->data + pos, &header, sizeof(header));
+    if (len > 0) {
+        memcpy(shm->data + pos + sizeof(header), data, len);
+    }
+    atomic_store(&shm->head, head + need);
+    ring_wake(ring, &shm->items, ring->items);
+}
+
+static inline void ring_wake_space(const Ring *ring, uint64_t tail)
+{
+    Shared_ring *shm = ring->shm;
+    if (atomic_load(&shm->head) - tail <= RING_LOW_WATER) {
+        ring_wake(ring, &shm->space, ring->space);
+    }
+}
+
+// Consumer side. Returns the payload of the next record in place; it stays
+// valid (and writable) until ring_release().
+static inline char *ring_peek(const Ring *ring, uint32_t *flags, uint32_t *len)
+{
+    Shared_ring *shm = ring->shm;
+    uint64_t tail = atomic_load_explicit(&shm->tail, memory_order_relaxed);
+
+    for (;;) {
+        ring_wait_change(ring, &shm->head, tail, &shm->items, ring->items);
+
+        uint32_t pos = tail % RING_SIZE;
+        uint32_t header;
+        memcpy(&header, shm->data + pos, sizeof(header));
+        if (header & REC_WRAP) {
+            tail += RING_SIZE - pos;
+            atomic_store(&shm->tail, tail);
+            ring_wake_space(ring, tail);
+            continue;
+        }
+
+        *flags = header & ~REC_LEN_MASK;
+        *len = header & REC_LEN_MASK;
+        return shm->data + pos + sizeof(header);
+    }
+}
+
+static inline void ring_release(const Ring *ring, uint32_t len)
+{
+    Shared_ring *shm = ring->shm;
+    uint64_t tail = atomic_load_explicit(&shm->tail, memory_order_relaxed);
+    tail += record_size(len);
+    atomic_store(&shm->tail, tail);
+    ring_wake_space(ring, tail);
+}
+
+// Worker pool (-j N). The segment then continues with a Work_pool right after
+// the Shared_ring. The parent cuts the mapped input into batches of whole
+// lines and pushes them into a bounded MPMC queue (Vyukov); any worker may pop
+// any batch. Results go to slot batch_id % POOL_SLOTS and the parent writes
+// the slots to stdout strictly in batch order, so output stays in line order.
+// Every job has at least one batch; its path lives in job_paths[job %
+// POOL_SLOTS], which cannot be reused while one of its batches is in flight.
+//
+// A slot holds segments: a uint32_t header (length | SEGMENT_ERROR) followed
+// by that many bytes of stdout text, or of stderr text if SEGMENT_ERROR is
+// set, so error messages come out between the sums of their batch. A worker
+// whose slot fills up waits until the parent has written every earlier batch
+// (written == its batch id), writes the slot itself and starts it over.
+#define POOL_SLOTS 64
+#define BATCH_LINES 1024
+#define BATCH_BYTES (256 * 1024)
+// Enough for a job header plus BATCH_LINES lines of "Sum in line %d = %d\n";
+// only batches with error messages can fill a slot early.
+#define RESULT_SIZE (48 * 1024)
+
+#define BATCH_HEADER 1u
+#define SEGMENT_ERROR 0x80000000u
+
+typedef struct {
+    uint64_t id;
+    uint64_t job;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t first_line;
+} Batch;
+
+typedef struct {
+    _Atomic uint64_t seq;
+    Batch batch;
+} Queue_cell;
+
+typedef struct {
+    _Atomic uint64_t ready;
+    uint64_t length;
+    // Set if the worker could not read the batch's file, so its lines are
+    // missing; the parent then exits with an error.
+    uint32_t failed;
+    char data[RESULT_SIZE];
+} Result_slot;
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t enqueue_pos;
+    _Alignas(64) _Atomic uint64_t dequeue_pos;
+    _Alignas(64) _Atomic uint64_t published;
+    Wait_point work;
+    _Alignas(64) _Atomic uint64_t completed;
+    Wait_point results;
+    // Batches the parent has written out, in order.
+    _Alignas(64) _Atomic uint64_t written;
+    Wait_point printed;
+    _Atomic int shutdown;
+    _Alignas(64) Queue_cell cells[POOL_SLOTS];
+    char job_paths[POOL_SLOTS][PATH_MAX];
+    Result_slot slots[POOL_SLOTS];
+} Work_pool;
+
+static inline void write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static inline void writev_all(int fd, struct iovec *iov, int count)
+{
+    int first = 0;
+    while (first < count) {
+        ssize_t n = writev(fd, iov + first, count - first);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        while (first < count && (size_t)n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (first < count) {
+            iov[first].iov_base = (char *)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+}
+
+// Adds the segments of a result slot to iov, which holds up to max entries of
+// stdout text waiting for writev. An error segment first writes out what is
+// pending, then goes to stderr itself. Returns the new entry count.
+static inline int write_segments(const char *data, size_t length, struct iovec *iov, int count, int max)
+{
+    size_t pos = 0;
+    while (pos < length) {
+        uint32_t header;
+        memcpy(&header, data + pos, sizeof(header));
+        uint32_t len = header & ~SEGMENT_ERROR;
+        const char *text = data + pos + sizeof(header);
+        pos += sizeof(header) + len;
+        if (header & SEGMENT_ERROR) {
+            writev_all(STDOUT_FILENO, iov, count);
+            count = 0;
+            write_all(STDERR_FILENO, text, len);
+            continue;
+        }
+        if (count == max) {
+            writev_all(STDOUT_FILENO, iov, count);
+            count = 0;
+        }
+        iov[count].iov_base = (void *)text;
+        iov[count].iov_len = len;
+        count++;
+    }
+    return count;
+}
+
+static inline Work_pool *pool_of(Shared_ring *shm)
+{
+    return (Work_pool *)(shm + 1);
+}
+
+static inline void pool_init(Work_pool *pool)
+{
+    memset(pool, 0, offsetof(Work_pool, slots));
+    for (uint64_t i = 0; i < POOL_SLOTS; i++) {
+        atomic_init(&pool->cells[i].seq, i);
+        atomic_init(&pool->slots[i].ready, 0);
+    }
+}
+
+static inline int pool_push(Work_pool *pool, const Batch *batch)
+{
+    uint64_t pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        Queue_cell *cell = &pool->cells[pos % POOL_SLOTS];
+        uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak(&pool->enqueue_pos, &pos, pos + 1)) {
+                cell->batch = *batch;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static inline int pool_pop(Work_pool *pool, Batch *batch)
+{
+    uint64_t pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        Queue_cell *cell = &pool->cells[pos % POOL_SLOTS];
+        uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - (pos + 1));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak(&pool->dequeue_pos, &pos, pos + 1)) {
+                *batch = cell->batch;
+                atomic_store_explicit(&cell->seq, pos + POOL_SLOTS, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Pool waits have several possible sleepers, so "waiting" counts them and a
+// wake releases all of them; the spin phase is the same as for the ring. With
+// a timeout it returns after one park even if nothing changed, so the caller
+// can look around (the parent checks on its workers) and wait again.
+static inline void pool_wait_change(int spin_limit, _Atomic uint64_t *counter, uint64_t seen,
+                                    Wait_point *wp, const struct timespec *timeout)
+{
+    for (int i = 0; i < spin_limit; i++) {
+        if (atomic_load_explicit(counter, memory_order_acquire) != seen) {
+            if (i > 0) {
+                atomic_fetch_add_explicit(&wp->spin_hits, 1, memory_order_relaxed);
+                atomic_fetch_add_explicit(&wp->spin_loops, i, memory_order_relaxed);
+            }
+            return;
+        }
+        cpu_relax();
+    }
+
+    while (atomic_load(counter) == seen) {
+        uint32_t seq = atomic_load(&wp->seq);
+        atomic_fetch_add(&wp->waiting, 1);
+        if (atomic_load(counter) == seen) {
+            atomic_fetch_add_explicit(&wp->parks, 1, memory_order_relaxed);
+            futex_wait_for(&wp->seq, seq, timeout);
+        }
+        atomic_fetch_sub(&wp->waiting, 1);
+        if (timeout != NULL) {
+            break;
+        }
+    }
+}
+
+static inline void pool_wake_all(Wait_point *wp)
+{
+    if (atomic_load(&wp->waiting) > 0) {
+        atomic_fetch_add_explicit(&wp->wakeups, 1, memory_order_relaxed);
+        atomic_fetch_add(&wp->seq, 1);
+        futex_wake(&wp->seq, INT32_MAX);
+    }
+}
+
+#endif
@@ -1,24 +1,380 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <immintrin.h>
+#include "magazine.h"
 
 #define PAGE_SIZE 4096
 #define MIN_BLOCK_SIZE 16
+#define MIN_BLOCK_SHIFT 4
+#define WORD_BITS 64
+#define ALL_FREE (~(uint64_t)0)
+#define ALL_USED ((uint64_t)0)
+// Words per leaf of the summary tree, so a leaf covers 512 blocks.
+#define LEAF_WORDS 8
+#define LEAF_BLOCKS (LEAF_WORDS * WORD_BITS)
 
+// Placement policy, from the ALLOCATOR_POLICY environment variable:
+//   first  lowest-address fit (default)
+//   next   lowest-address fit at or after the end of the last allocation,
+//          wrapping around to the start of the arena
+//   best   descends towards the smallest sufficient free run; the choice at
+//          each level is made from the summaries alone, so the run is the
+//          tightest in its leaf but not always in the whole arena
+enum policy {
+    POLICY_FIRST,
+    POLICY_NEXT,
+    POLICY_BEST
+};
+
+// The allocation map has one bit per block, set while the block is free,
+// packed into 64-bit words: block i is bit i % 64 of word i / 64. Bits past
+// the last block are kept clear so a free run never runs off the end.
+//
+// Over the map sits a summary tree: a complete binary tree whose leaves are
+// the LEAF_BLOCKS-block regions of the map, stored heap-style with the root
+// at 1 and the children of node i at 2i and 2i + 1. For its span of blocks
+// every node records the free run at its start (prefix), at its end
+// (suffix) and the longest free run (longest). An allocation walks down from
+// the root to where a fit lies, and only scans the map inside one leaf.
+// Leaves past the end of the map cover no blocks and stay all zero.
 typedef struct {
     unsigned char *memory_region;
     size_t total_memory_size;
     size_t total_blocks;
-    unsigned char *allocation_map;
+    uint64_t *allocation_map;
     size_t map_size;
+    size_t map_words;
+    // Skips words equal to a value; AVX2 when the CPU has it.
+    size_t (*skip_words)(const uint64_t *words, size_t from, size_t end, uint64_t value);
+    uint32_t *prefix;
+    uint32_t *suffix;
+    uint32_t *longest;
+    size_t summary_leaves;
+    size_t summary_size;
+    enum policy policy;
+    // Where next-fit starts looking.
+    size_t rover;
+    // Set by ALLOCATOR_THREAD_SAFE=1: calls go through per-thread caches
+    // and a lock, see magazine.h.
+    int thread_safe;
+    MagazineDepot magazines;
 } MemoryAllocator;
 
 static size_t calculate_allocation_map_size(size_t block_count) {
-    return (block_count + 7) / 8;
+    return (block_count + WORD_BITS - 1) / WORD_BITS * sizeof(uint64_t);
+}
+
+// Index of the first word in [from, end) that is not value, or end.
+static size_t skip_words_scalar(const uint64_t *words, size_t from, size_t end, uint64_t value) {
+    while (from < end && words[from] == value) {
+        from++;
+    }
+    return from;
+}
+
+// Same, comparing eight words (512 blocks) per step.
+__attribute__((target("avx2")))
+static size_t skip_words_avx2(const uint64_t *words, size_t from, size_t end, uint64_t value) {
+    __m256i pattern = _mm256_set1_epi64x((long long)value);
+    while (from + 8 <= end) {
+        __m256i low = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(words + from)), pattern);
+        __m256i high = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(words + from + 4)), pattern);
+        if (!_mm256_testc_si256(_mm256_and_si256(low, high), _mm256_set1_epi64x(-1))) {
+            int equal = _mm256_movemask_pd(_mm256_castsi256_pd(low)) |
+                        _mm256_movemask_pd(_mm256_castsi256_pd(high)) << 4;
+            return from + __builtin_ctz(~equal);
+        }
+        from += 8;
+    }
+    return skip_words_scalar(words, from, end, value);
+}
+
+// Returns the first block of the lowest run of at least count free blocks
+// that starts at or after block from and ends before word end, or SIZE_MAX.
+// Whole free or used words are skipped in bulk. In any other word the run
+// carried in from the words before continues through its trailing free bits,
+// a run of fewer than 64 blocks may lie wholly inside it, and its leading
+// free bits start the run carried into the next word.
+static size_t find_free_run(const MemoryAllocator *allocator, size_t count, size_t from,
+                            size_t end) {
+    const uint64_t *words = allocator->allocation_map;
+    size_t run_start = 0, run_length = 0;
+
+    for (size_t w = from / WORD_BITS; w < end;) {
+        uint64_t word = words[w];
+        if (w == from / WORD_BITS) {
+            // Blocks before from count as used.
+            word &= ALL_FREE << (from % WORD_BITS);
+        }
+        if (word == ALL_FREE) {
+            if (run_length == 0) {
+                run_start = w * WORD_BITS;
+            }
+            // No further than the words the run still needs.
+            size_t needed = (count - run_length + WORD_BITS - 1) / WORD_BITS;
+            size_t next = allocator->skip_words(words, w + 1, w + needed < end ? w + needed : end, ALL_FREE);
+            run_length += (next - w) * WORD_BITS;
+            if (run_length >= count) {
+                return run_start;
+            }
+            w = next;
+            continue;
+        }
+        if (word == ALL_USED) {
+            run_length = 0;
+            w = allocator->skip_words(words, w + 1, end, ALL_USED);
+            continue;
+        }
+
+        if (run_length == 0) {
+            run_start = w * WORD_BITS;
+        }
+        if (run_length + __builtin_ctzll(~word) >= count) {
+            return run_start;
+        }
+        if (count < WORD_BITS) {
+            // Bit i of starts ends up set if bits i .. i + count - 1 of the
+            // word are all free; each step doubles the length checked.
+            uint64_t starts = word;
+            for (size_t length = 1; length < count;) {
+                size_t shift = length < count - length ? length : count - length;
+                starts &= starts >> shift;
+                length += shift;
+            }
+            if (starts) {
+                return w * WORD_BITS + __builtin_ctzll(starts);
+            }
+        }
+        run_length = __builtin_clzll(~word);
+        run_start = (w + 1) * WORD_BITS - run_length;
+        w++;
+    }
+    return SIZE_MAX;
+}
+
+// Marks blocks [first, first + count) free or used, a word at a time.
+static void mark_blocks(uint64_t *words, size_t first, size_t count, int to_free) {
+    size_t first_word = first / WORD_BITS;
+    size_t last_word = (first + count - 1) / WORD_BITS;
+    uint64_t head = ALL_FREE << (first % WORD_BITS);
+    uint64_t tail = ALL_FREE >> (WORD_BITS - 1 - (first + count - 1) % WORD_BITS);
+
+    if (first_word == last_word) {
+        head &= tail;
+    }
+    words[first_word] = to_free ? words[first_word] | head : words[first_word] & ~head;
+    if (first_word == last_word) {
+        return;
+    }
+    memset(words + first_word + 1, to_free ? 0xFF : 0x00,
+           (last_word - first_word - 1) * sizeof(uint64_t));
+    words[last_word] = to_free ? words[last_word] | tail : words[last_word] & ~tail;
+}
+
+// Longest run of set bits in a word: each step shortens every run by one.
+static uint32_t longest_in_word(uint64_t word) {
+    uint32_t length = 0;
+    while (word) {
+        word &= word >> 1;
+        length++;
+    }
+    return length;
+}
+
+// Recomputes a leaf's summary from its words of the map. Words past the end
+// of the map count as used, so a run is only ever a suffix if it reaches the
+// end of the leaf's full span.
+static void summarize_leaf(MemoryAllocator *allocator, size_t leaf) {
+    size_t first = leaf * LEAF_WORDS;
+    uint32_t prefix = 0, longest = 0, run = 0;
+    int in_prefix = 1;
+
+    for (size_t w = first; w < first + LEAF_WORDS; w++) {
+        uint64_t word = w < allocator->map_words ? allocator->allocation_map[w] : ALL_USED;
+        if (word == ALL_FREE) {
+            run += WORD_BITS;
+            continue;
+        }
+        run += __builtin_ctzll(~word);
+        if (in_prefix) {
+            prefix = run;
+            in_prefix = 0;
+        }
+        uint32_t inside = longest_in_word(word);
+        longest = run > longest ? run : longest;
+        longest = inside > longest ? inside : longest;
+        run = __builtin_clzll(~word);
+    }
+    if (in_prefix) {
+        prefix = run;
+    }
+
+    size_t node = allocator->summary_leaves + leaf;
+    allocator->prefix[node] = prefix;
+    allocator->suffix[node] = run;
+    allocator->longest[node] = run > longest ? run : longest;
+}
+
+// Combines the summaries of node's children, which span half blocks each.
+static void merge_children(MemoryAllocator *allocator, size_t node, size_t half) {
+    size_t left = 2 * node, right = left + 1;
+    uint32_t *prefix = allocator->prefix, *suffix = allocator->suffix, *longest = allocator->longest;
+    uint32_t across = suffix[left] + prefix[right];
+
+    prefix[node] = prefix[left] == half ? half + prefix[right] : prefix[left];
+    suffix[node] = suffix[right] == half ? half + suffix[left] : suffix[right];
+    longest[node] = longest[left] > longest[right] ? longest[left] : longest[right];
+    longest[node] = across > longest[node] ? across : longest[node];
+}
+
+// Brings the summaries up to date after blocks [first, first + count)
+// changed: their leaves, then every ancestor of those leaves.
+static void update_summary(MemoryAllocator *allocator, size_t first, size_t count) {
+    size_t lo = first / LEAF_BLOCKS, hi = (first + count - 1) / LEAF_BLOCKS;
+    for (size_t leaf = lo; leaf <= hi; leaf++) {
+        summarize_leaf(allocator, leaf);
+    }
+    lo += allocator->summary_leaves;
+    hi += allocator->summary_leaves;
+    for (size_t half = LEAF_BLOCKS; lo > 1; half *= 2) {
+        lo /= 2;
+        hi /= 2;
+        for (size_t node = lo; node <= hi; node++) {
+            merge_children(allocator, node, half);
+        }
+    }
+}
+
+// Lowest-address fit inside the span of node, which starts at block start
+// and is span blocks long. At each level the fit is in the left child, across
+// the middle, or in the right child, in that order of address.
+static size_t find_first(const MemoryAllocator *allocator, size_t count, size_t node,
+                         size_t start, size_t span) {
+    if (allocator->longest[node] < count) {
+        return SIZE_MAX;
+    }
+    while (node < allocator->summary_leaves) {
+        size_t left = 2 * node, right = left + 1;
+        span /= 2;
+        if (allocator->longest[left] >= count) {
+            node = left;
+        } else if (allocator->suffix[left] + allocator->prefix[right] >= count) {
+            return start + span - allocator->suffix[left];
+        } else {
+            node = right;
+            start += span;
+        }
+    }
+    size_t first_word = start / WORD_BITS;
+    size_t end = first_word + LEAF_WORDS < allocator->map_words ? first_word + LEAF_WORDS : allocator->map_words;
+    return find_free_run(allocator, count, start, end);
+}
+
+// Lowest-address fit inside the span of node that starts at or after block
+// from. Only the O(log n) nodes the span boundary cuts through are split;
+// every node wholly after from is handed to find_first.
+static size_t find_from(const MemoryAllocator *allocator, size_t count, size_t node,
+                        size_t start, size_t span, size_t from) {
+    if (start + span <= from || allocator->longest[node] < count) {
+        return SIZE_MAX;
+    }
+    if (from <= start) {
+        return find_first(allocator, count, node, start, span);
+    }
+    if (node >= allocator->summary_leaves) {
+        size_t end = start / WORD_BITS + LEAF_WORDS;
+        return find_free_run(allocator, count, from, end < allocator->map_words ? end : allocator->map_words);
+    }
+
+    size_t left = 2 * node, right = left + 1, half = span / 2;
+    size_t found = find_from(allocator, count, left, start, half, from);
+    if (found != SIZE_MAX) {
+        return found;
+    }
+    size_t middle = start + half;
+    size_t across = middle - allocator->suffix[left];
+    across = across > from ? across : from;
+    if (across < middle && middle - across + allocator->prefix[right] >= count) {
+        return across;
+    }
+    return find_from(allocator, count, right, middle, half, from);
+}
+
+// Smallest maximal free run of at least count blocks inside one leaf.
+static size_t best_in_leaf(const MemoryAllocator *allocator, size_t count, size_t start) {
+    const uint64_t *words = allocator->allocation_map;
+    size_t end = start + LEAF_BLOCKS;
+    if (end > allocator->map_words * WORD_BITS) {
+        end = allocator->map_words * WORD_BITS;
+    }
+    size_t best = SIZE_MAX, best_length = SIZE_MAX;
+
+    for (size_t block = start; block < end;) {
+        // Skip to the next free block, then to the next used one.
+        uint64_t word = words[block / WORD_BITS] & (ALL_FREE << (block % WORD_BITS));
+        if (word == 0) {
+            block = (block / WORD_BITS + 1) * WORD_BITS;
+            continue;
+        }
+        size_t run_start = block / WORD_BITS * WORD_BITS + __builtin_ctzll(word);
+        size_t run_end = run_start;
+        for (;;) {
+            uint64_t used = ~words[run_end / WORD_BITS] & (ALL_FREE << (run_end % WORD_BITS));
+            if (used != 0) {
+                run_end = run_end / WORD_BITS * WORD_BITS + __builtin_ctzll(used);
+                break;
+            }
+            run_end = (run_end / WORD_BITS + 1) * WORD_BITS;
+            if (run_end >= end) {
+                run_end = end;
+                break;
+            }
+        }
+        size_t length = run_end - run_start;
+        if (length >= count && length < best_length) {
+            best = run_start;
+            best_length = length;
+        }
+        block = run_end;
+    }
+    return best;
+}
+
+// Best fit as described at enum policy: at each node the candidates are the
+// left child, the run across the middle and the right child, and the one
+// whose longest run is the smallest that still fits wins (leftmost on ties).
+static size_t find_best(const MemoryAllocator *allocator, size_t count) {
+    if (allocator->longest[1] < count) {
+        return SIZE_MAX;
+    }
+    size_t node = 1, start = 0, span = allocator->summary_leaves * LEAF_BLOCKS;
+    while (node < allocator->summary_leaves) {
+        size_t left = 2 * node, right = left + 1;
+        span /= 2;
+        size_t across = allocator->suffix[left] + allocator->prefix[right];
+        size_t fit_left = allocator->longest[left] >= count ? allocator->longest[left] : SIZE_MAX;
+        size_t fit_right = allocator->longest[right] >= count ? allocator->longest[right] : SIZE_MAX;
+        size_t fit_across = across >= count ? across : SIZE_MAX;
+        if (fit_left <= fit_across && fit_left <= fit_right) {
+            node = left;
+        } else if (fit_across <= fit_right) {
+            return start + span - allocator->suffix[left];
+        } else {
+            node = right;
+            start += span;
+        }
+    }
+    return best_in_leaf(allocator, count, start);
 }
 
+static void *central_alloc(void *owner, size_t size, int report);
+static void central_free(void *owner, void *memory, size_t size);
+void allocator_destroy(MemoryAllocator *allocator);
+
 MemoryAllocator *allocator_create(void *const memory, size_t requested_size) {
     if (requested_size == 0) {
         fprintf(stderr, "Error: Requested size is zero\n");
@@ -29,6 +385,16 @@ MemoryAllocator *allocator_create(void *const memory, size_t requested_size) {
 
     size_t block_count = requested_size / MIN_BLOCK_SIZE;
     size_t allocation_map_size = calculate_allocation_map_size(block_count);
+    if (block_count > UINT32_MAX) {
+        // The summaries count blocks in 32 bits.
+        fprintf(stderr, "Error: Requested size is too large\n");
+        return NULL;
+    }
+    size_t summary_leaves = 1;
+    while (summary_leaves * LEAF_BLOCKS < block_count) {
+        summary_leaves *= 2;
+    }
+    size_t summary_bytes = 3 * 2 * summary_leaves * sizeof(uint32_t);
 
     MemoryAllocator *allocator = mmap(NULL, sizeof(MemoryAllocator), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (allocator == MAP_FAILED) {
@@ -51,53 +417,109 @@ MemoryAllocator *allocator_create(void *const memory, size_t requested_size) {
         return NULL;
     }
 
+    allocator->prefix = mmap(NULL, summary_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (allocator->prefix == MAP_FAILED) {
+        perror("Error mmap for summary tree");
+        munmap(allocator->allocation_map, allocation_map_size);
+        munmap(allocator->memory_region, requested_size);
+        munmap(allocator, sizeof(MemoryAllocator));
+        return NULL;
+    }
+    allocator->suffix = allocator->prefix + 2 * summary_leaves;
+    allocator->longest = allocator->suffix + 2 * summary_leaves;
+    allocator->summary_leaves = summary_leaves;
+    allocator->summary_size = summary_bytes;
+
     allocator->total_memory_size = requested_size;
     allocator->total_blocks = block_count;
     allocator->map_size = allocation_map_size;
+    allocator->map_words = allocation_map_size / sizeof(uint64_t);
     memset(allocator->allocation_map, 0xFF, allocation_map_size);
+    if (block_count % WORD_BITS != 0) {
+        allocator->allocation_map[allocator->map_words - 1] = ALL_FREE >> (WORD_BITS - block_count % WORD_BITS);
+    }
+
+    __builtin_cpu_init();
+    allocator->skip_words = __builtin_cpu_supports("avx2") ? skip_words_avx2 : skip_words_scalar;
+
+    for (size_t leaf = 0; leaf * LEAF_WORDS < allocator->map_words; leaf++) {
+        summarize_leaf(allocator, leaf);
+    }
+    for (size_t level = summary_leaves / 2, half = LEAF_BLOCKS; level >= 1; level /= 2, half *= 2) {
+        for (size_t node = level; node < 2 * level; node++) {
+            merge_children(allocator, node, half);
+        }
+    }
+
+    const char *policy = getenv("ALLOCATOR_POLICY");
+    allocator->policy = POLICY_FIRST;
+    if (policy != NULL && strcmp(policy, "next") == 0) {
+        allocator->policy = POLICY_NEXT;
+    } else if (policy != NULL && strcmp(policy, "best") == 0) {
+        allocator->policy = POLICY_BEST;
+    } else if (policy != NULL && strcmp(policy, "first") != 0) {
+        fprintf(stderr, "Error: Unknown ALLOCATOR_POLICY, using first fit\n");
+    }
+    allocator->rover = 0;
+
+    const char *thread_safe = getenv("ALLOCATOR_THREAD_SAFE");
+    allocator->thread_safe = 0;
+    if (thread_safe != NULL && strcmp(thread_safe, "1") == 0) {
+        if (magazine_init(&allocator->magazines, allocator, MIN_BLOCK_SHIFT, central_alloc, central_free) != 0) {
+            fprintf(stderr, "Error: Cannot set up thread caches\n");
+            allocator_destroy(allocator);
+            return NULL;
+        }
+        allocator->thread_safe = 1;
+    }
 
     return allocator;
 }
 
-void *allocator_alloc(MemoryAllocator *allocator, size_t size) {
+// Prints why a request failed only if report is set.
+static void *alloc_blocks(MemoryAllocator *allocator, size_t size, int report) {
     if (!allocator || size == 0) {
-        fprintf(stderr, "Error: Invalid allocation request\n");
+        if (report) {
+            fprintf(stderr, "Error: Invalid allocation request\n");
+        }
         return NULL;
     }
 
     if (size > allocator->total_memory_size) {
-        fprintf(stderr, "Error: Requested size exceeds total memory\n");
+        if (report) {
+            fprintf(stderr, "Error: Requested size exceeds total memory\n");
+        }
         return NULL;
     }
 
     size_t required_blocks = (size + MIN_BLOCK_SIZE - 1) / MIN_BLOCK_SIZE;
 
-    for (size_t i = 0; i < allocator->total_blocks - required_blocks + 1;) {
-        size_t j;
-        for (j = 0; j < required_blocks; j++) {
-            size_t byte_index = (i + j) / 8;
-            size_t bit_offset = (i + j) % 8;
-            if (!(allocator->allocation_map[byte_index] & (1 << bit_offset))) {
-                break;
-            }
+    size_t span = allocator->summary_leaves * LEAF_BLOCKS;
+    size_t first_block;
+    if (allocator->policy == POLICY_BEST) {
+        first_block = find_best(allocator, required_blocks);
+    } else if (allocator->policy == POLICY_NEXT) {
+        first_block = find_from(allocator, required_blocks, 1, 0, span, allocator->rover);
+        if (first_block == SIZE_MAX) {
+            first_block = find_first(allocator, required_blocks, 1, 0, span);
         }
-
-        if (j == required_blocks) {
-            for (j = 0; j < required_blocks; j++) {
-                size_t byte_index = (i + j) / 8;
-                size_t bit_offset = (i + j) % 8;
-                allocator->allocation_map[byte_index] &= ~(1 << bit_offset);
-            }
-            return allocator->memory_region + i * MIN_BLOCK_SIZE;
+    } else {
+        first_block = find_first(allocator, required_blocks, 1, 0, span);
+    }
+    if (first_block == SIZE_MAX) {
+        if (report) {
+            fprintf(stderr, "Error: Not enough free memory\n");
         }
-        i += j + 1;
+        return NULL;
     }
 
-    fprintf(stderr, "Error: Not enough free memory\n");
-    return NULL;
+    mark_blocks(allocator->allocation_map, first_block, required_blocks, 0);
+    update_summary(allocator, first_block, required_blocks);
+    allocator->rover = first_block + required_blocks;
+    return allocator->memory_region + first_block * MIN_BLOCK_SIZE;
 }
 
-void allocator_free(MemoryAllocator *allocator, void *ptr, size_t size) {
+static void free_blocks(MemoryAllocator *allocator, void *ptr, size_t size) {
     if (!allocator || !ptr || size == 0) {
         fprintf(stderr, "Error: Invalid free request\n");
         return;
@@ -124,9 +546,31 @@ void allocator_free(MemoryAllocator *allocator, void *ptr, size_t size) {
         return;
     }
 
-    for (size_t i = starting_block_index; i < starting_block_index + blocks_to_free; i++) {
-        allocator->allocation_map[i / 8] |= (1 << (i % 8));
+    mark_blocks(allocator->allocation_map, starting_block_index, blocks_to_free, 1);
+    update_summary(allocator, starting_block_index, blocks_to_free);
+}
+
+static void *central_alloc(void *owner, size_t size, int report) {
+    return alloc_blocks(owner, size, report);
+}
+
+static void central_free(void *owner, void *memory, size_t size) {
+    free_blocks(owner, memory, size);
+}
+
+void *allocator_alloc(MemoryAllocator *allocator, size_t size) {
+    if (allocator && allocator->thread_safe) {
+        return magazine_alloc(&allocator->magazines, size);
     }
+    return alloc_blocks(allocator, size, 1);
+}
+
+void allocator_free(MemoryAllocator *allocator, void *ptr, size_t size) {
+    if (allocator && allocator->thread_safe && ptr) {
+        magazine_free(&allocator->magazines, ptr, size);
+        return;
+    }
+    free_blocks(allocator, ptr, size);
 }
 
 void allocator_destroy(MemoryAllocator *allocator) {
@@ -135,6 +579,16 @@ void allocator_destroy(MemoryAllocator *allocator) {
         return;
     }
 
+    if (allocator->thread_safe) {
+        magazine_destroy(&allocator->magazines);
+        allocator->thread_safe = 0;
+    }
+
+    if (allocator->prefix) {
+        munmap(allocator->prefix, allocator->summary_size);
+        allocator->prefix = allocator->suffix = allocator->longest = NULL;
+    }
+
     if (allocator->allocation_map) {
         munmap(allocator->allocation_map, allocator->map_size);
         allocator->allocation_map = NULL;
@@ -1,24 +1,121 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
 #include <sys/mman.h>
 #include <string.h>
 #include <stdint.h>
+#include "magazine.h"
 
+#define PAGE_SIZE 4096
+#define MIN_BLOCK_SHIFT 6
+#define MIN_BLOCK_SIZE (1 << MIN_BLOCK_SHIFT)
+#define WORD_BITS 64
+#define NOT_ALLOCATED 0
+
+// A free block holds its own list links, so MIN_BLOCK_SIZE must fit them.
+typedef struct FreeBlock {
+    struct FreeBlock *next;
+    struct FreeBlock *prev;
+} FreeBlock;
+
+// Level 0 holds MIN_BLOCK_SIZE blocks and each level up doubles the size.
+// Block i of a level starts at memory_region + i * (MIN_BLOCK_SIZE << level),
+// and its buddy is block i ^ 1 of the same level.
+//
+// The region is not rounded up to a power of two. It is split into one root
+// block per set bit of its size in MIN_BLOCK_SIZE units, largest first, so
+// each root is aligned to its own size. The buddy of a root would lie in the
+// smaller roots after it, where no block of its level can exist, so a root
+// never merges further.
+//
+// free_lists[level] is a doubly linked list of the free blocks of that
+// level, and free_maps[level] has one bit per block of the level, set while
+// the block is on the list, so whether a buddy is free is a single bit test.
+// block_levels has a byte per MIN_BLOCK_SIZE block: one more than the level
+// of the allocated block starting there, which is how free learns the block
+// size, or NOT_ALLOCATED if no allocated block starts there.
 typedef struct BuddyAllocator {
     void *memory_region;
     size_t total_memory_size;
-    size_t min_block_size;
+    // Size of the largest root, the largest possible allocation.
     size_t max_block_size;
     int max_levels;
-    void **free_lists;
+    FreeBlock **free_lists;
+    uint64_t **free_maps;
+    uint8_t *block_levels;
+    void *metadata;
+    size_t metadata_size;
+    // Set by ALLOCATOR_THREAD_SAFE=1: calls go through per-thread caches
+    // and a lock, see magazine.h. The size classes are the levels.
+    int thread_safe;
+    MagazineDepot magazines;
 } BuddyAllocator;
 
+static size_t block_index(const BuddyAllocator *allocator, const void *block, int level) {
+    return (size_t)((const char *)block - (const char *)allocator->memory_region) >> (MIN_BLOCK_SHIFT + level);
+}
+
+// Smallest level whose blocks hold size bytes: the bit length of the number
+// of whole MIN_BLOCK_SIZE blocks below size.
+static int level_for_size(size_t size) {
+    size_t below = (size - 1) >> MIN_BLOCK_SHIFT;
+    return below == 0 ? 0 : WORD_BITS - __builtin_clzll(below);
+}
+
+static int is_free(const BuddyAllocator *allocator, int level, size_t index) {
+    return (allocator->free_maps[level][index / WORD_BITS] >> (index % WORD_BITS)) & 1;
+}
+
+static void push_free(BuddyAllocator *allocator, void *memory, int level) {
+    FreeBlock *block = memory;
+    block->prev = NULL;
+    block->next = allocator->free_lists[level];
+    if (block->next != NULL) {
+        block->next->prev = block;
+    }
+    allocator->free_lists[level] = block;
+
+    size_t index = block_index(allocator, block, level);
+    allocator->free_maps[level][index / WORD_BITS] |= (uint64_t)1 << (index % WORD_BITS);
+}
+
+static void remove_free(BuddyAllocator *allocator, FreeBlock *block, int level) {
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        allocator->free_lists[level] = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+
+    size_t index = block_index(allocator, block, level);
+    allocator->free_maps[level][index / WORD_BITS] &= ~((uint64_t)1 << (index % WORD_BITS));
+}
+
+static void *central_alloc(void *owner, size_t size, int report);
+static void central_free(void *owner, void *memory, size_t size);
+void allocator_destroy(BuddyAllocator *const allocator);
+
 BuddyAllocator *allocator_create(void *const memory, const size_t size) {
-    size_t total_size = pow(2, ceil(log2(size)));
-    size_t min_block_size = 64;
-    size_t max_block_size = total_size;
-    int max_levels = log2(max_block_size / min_block_size) + 1;
+    if (size == 0) {
+        fprintf(stderr, "Error: Requested size is zero\n");
+        return NULL;
+    }
+
+    size_t total_size = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    size_t min_blocks = total_size >> MIN_BLOCK_SHIFT;
+    int max_levels = WORD_BITS - __builtin_clzll(min_blocks);
+    size_t max_block_size = (size_t)MIN_BLOCK_SIZE << (max_levels - 1);
+
+    // One mapping for the list heads, the bitmap pointers, the bitmaps of
+    // every level and the level table. A level's bitmap also covers the
+    // buddy just past its last block, which is never free.
+    size_t map_words = 0;
+    for (int level = 0; level < max_levels; level++) {
+        map_words += (min_blocks >> level) / WORD_BITS + 1;
+    }
+    size_t metadata_size = max_levels * (sizeof(FreeBlock *) + sizeof(uint64_t *)) +
+                           map_words * sizeof(uint64_t) + min_blocks;
 
     BuddyAllocator *allocator = mmap(NULL, sizeof(BuddyAllocator),
                                      PROT_READ | PROT_WRITE,
@@ -36,77 +133,175 @@ BuddyAllocator *allocator_create(void *const memory, const size_t size) {
         return NULL;
     }
 
-    allocator->total_memory_size = total_size;
-    allocator->min_block_size = min_block_size;
-    allocator->max_block_size = max_block_size;
-    allocator->max_levels = max_levels;
-
-    allocator->free_lists = mmap(NULL, max_levels * sizeof(void *),
-                                 PROT_READ | PROT_WRITE,
-                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (allocator->free_lists == MAP_FAILED) {
+    allocator->metadata = mmap(NULL, metadata_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (allocator->metadata == MAP_FAILED) {
         perror("mmap");
         munmap(allocator->memory_region, total_size);
         munmap(allocator, sizeof(BuddyAllocator));
         return NULL;
     }
 
-    memset(allocator->free_lists, 0, max_levels * sizeof(void *));
-    allocator->free_lists[max_levels - 1] = allocator->memory_region;
+    allocator->total_memory_size = total_size;
+    allocator->max_block_size = max_block_size;
+    allocator->max_levels = max_levels;
+    allocator->metadata_size = metadata_size;
 
+    // Anonymous mappings start zeroed: empty lists, nothing free.
+    allocator->free_lists = allocator->metadata;
+    allocator->free_maps = (uint64_t **)(allocator->free_lists + max_levels);
+    uint64_t *words = (uint64_t *)(allocator->free_maps + max_levels);
+    for (int level = 0; level < max_levels; level++) {
+        allocator->free_maps[level] = words;
+        words += (min_blocks >> level) / WORD_BITS + 1;
+    }
+    allocator->block_levels = (uint8_t *)words;
+
+    char *root = allocator->memory_region;
+    for (int level = max_levels - 1; level >= 0; level--) {
+        if ((min_blocks >> level) & 1) {
+            push_free(allocator, root, level);
+            root += (size_t)MIN_BLOCK_SIZE << level;
+        }
+    }
+
+    const char *thread_safe = getenv("ALLOCATOR_THREAD_SAFE");
+    allocator->thread_safe = 0;
+    if (thread_safe != NULL && strcmp(thread_safe, "1") == 0) {
+        if (magazine_init(&allocator->magazines, allocator, MIN_BLOCK_SHIFT, central_alloc, central_free) != 0) {
+            fprintf(stderr, "Error: Cannot set up thread caches\n");
+            allocator_destroy(allocator);
+            return NULL;
+        }
+        allocator->thread_safe = 1;
+    }
+
+    (void)memory;
     return allocator;
 }
 
-void *allocator_alloc(BuddyAllocator *const allocator, const size_t size) {
-    size_t adjusted_size = size < allocator->min_block_size ? allocator->min_block_size : size;
-    int level = log2(allocator->max_block_size / adjusted_size);
-
-    for (int i = level; i < allocator->max_levels; i++) {
-        if (allocator->free_lists[i] != NULL) {
-            void *block = allocator->free_lists[i];
-            allocator->free_lists[i] = *(void **)block;
-
-            while (i > level) {
-                i--;
-                void *buddy = (void *)((char *)block + (allocator->min_block_size << i));
-                *(void **)buddy = allocator->free_lists[i];
-                allocator->free_lists[i] = buddy;
-            }
-
-            return block;
+// Prints why a request failed only if report is set.
+static void *alloc_block(BuddyAllocator *const allocator, const size_t size, int report) {
+    if (!allocator || size == 0) {
+        if (report) {
+            fprintf(stderr, "Error: Invalid allocation request\n");
         }
+        return NULL;
+    }
+    if (size > allocator->max_block_size) {
+        if (report) {
+            fprintf(stderr, "Error: Requested size exceeds total memory\n");
+        }
+        return NULL;
+    }
+
+    int level = level_for_size(size);
+
+    int i = level;
+    while (i < allocator->max_levels && allocator->free_lists[i] == NULL) {
+        i++;
+    }
+    if (i == allocator->max_levels) {
+        if (report) {
+            fprintf(stderr, "Error: Not enough free memory\n");
+        }
+        return NULL;
     }
 
-    return NULL;
+    FreeBlock *block = allocator->free_lists[i];
+    remove_free(allocator, block, i);
+
+    // Split down to the requested level; the upper halves stay free.
+    while (i > level) {
+        i--;
+        push_free(allocator, (char *)block + ((size_t)MIN_BLOCK_SIZE << i), i);
+    }
+
+    allocator->block_levels[block_index(allocator, block, 0)] = level + 1;
+    return block;
 }
 
 void allocator_destroy(BuddyAllocator *const allocator) {
-    munmap(allocator->free_lists, allocator->max_levels * sizeof(void *));
+    if (!allocator) {
+        fprintf(stderr, "Error: Attempt to destroy a non-existent allocator\n");
+        return;
+    }
+
+    if (allocator->thread_safe) {
+        magazine_destroy(&allocator->magazines);
+        allocator->thread_safe = 0;
+    }
+
+    munmap(allocator->metadata, allocator->metadata_size);
     munmap(allocator->memory_region, allocator->total_memory_size);
     munmap(allocator, sizeof(BuddyAllocator));
 }
 
-void allocator_free(BuddyAllocator *const allocator, void *const memory) {
-    size_t size = allocator->min_block_size;
-    int level = log2(allocator->max_block_size / size);
-    void *ptr = memory;
+// size is only checked against the block: the level table knows its size.
+static void free_block(BuddyAllocator *const allocator, void *const memory, size_t size) {
+    if (!allocator || !memory) {
+        fprintf(stderr, "Error: Invalid free request\n");
+        return;
+    }
 
-    while (level < allocator->max_levels - 1) {
-        void *buddy = (void *)((uintptr_t)ptr ^ (allocator->min_block_size << level));
-        void **prev = &allocator->free_lists[level];
-        while (*prev != NULL && *prev != buddy) {
-            prev = (void **)*prev;
-        }
+    char *ptr = memory;
+    char *region = allocator->memory_region;
+    if (ptr < region || ptr >= region + allocator->total_memory_size) {
+        fprintf(stderr, "Error: Pointer out of allocator bounds\n");
+        return;
+    }
+
+    if ((ptr - region) % MIN_BLOCK_SIZE != 0) {
+        fprintf(stderr, "Error: Pointer is not aligned to block boundary\n");
+        return;
+    }
+
+    size_t index = block_index(allocator, ptr, 0);
+    if (allocator->block_levels[index] == NOT_ALLOCATED) {
+        fprintf(stderr, "Error: Pointer is not an allocated block\n");
+        return;
+    }
+    int level = allocator->block_levels[index] - 1;
+    if (size > ((size_t)MIN_BLOCK_SIZE << level)) {
+        fprintf(stderr, "Error: Size is larger than the block\n");
+        return;
+    }
+    allocator->block_levels[index] = NOT_ALLOCATED;
 
-        if (*prev == buddy) {
-            *prev = *(void **)buddy;
-            ptr = (ptr < buddy) ? ptr : buddy;
-            level++;
-        } else {
+    // index stays in MIN_BLOCK_SIZE units: the pair at level l differs only
+    // in bit l, and the merged block starts where bit l is clear.
+    while (level < allocator->max_levels - 1) {
+        size_t buddy = (index >> level) ^ 1;
+        if (!is_free(allocator, level, buddy)) {
             break;
         }
+        remove_free(allocator, (FreeBlock *)(region + ((buddy << level) << MIN_BLOCK_SHIFT)), level);
+        index &= ~((size_t)1 << level);
+        level++;
     }
 
-    *(void **)ptr = allocator->free_lists[level];
-    allocator->free_lists[level] = ptr;
+    push_free(allocator, region + (index << MIN_BLOCK_SHIFT), level);
+}
+
+static void *central_alloc(void *owner, size_t size, int report) {
+    return alloc_block(owner, size, report);
+}
+
+static void central_free(void *owner, void *memory, size_t size) {
+    free_block(owner, memory, size);
+}
+
+void *allocator_alloc(BuddyAllocator *const allocator, const size_t size) {
+    if (allocator && allocator->thread_safe) {
+        return magazine_alloc(&allocator->magazines, size);
+    }
+    return alloc_block(allocator, size, 1);
+}
+
+void allocator_free(BuddyAllocator *const allocator, void *const memory, size_t size) {
+    if (allocator && allocator->thread_safe && memory) {
+        magazine_free(&allocator->magazines, memory, size);
+        return;
+    }
+    free_block(allocator, memory, size);
 }
@@ -0,0 +1,65 @@
+#ifndef LAB_4_BENCH_H
+#define LAB_4_BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <time.h>
+
+// What the lab_4 benchmarks share: each one loads an allocator library with
+// the same four functions main.c loads, times calls with CLOCK_MONOTONIC and
+// reports latencies as percentiles.
+
+typedef struct {
+    void *(*allocator_create)(void *const memory, const size_t size);
+    void (*allocator_destroy)(void *const allocator);
+    void *(*allocator_alloc)(void *const allocator, const size_t size);
+    void (*allocator_free)(void *const allocator, void *const memory, size_t size);
+} AllocatorAPI;
+
+// Opens the library at path and fills api from it. Returns the handle for
+// dlclose, or NULL after printing why the library cannot be used.
+static inline void *bench_load(const char *path, AllocatorAPI *api) {
+    void *handle = dlopen(path, RTLD_LAZY);
+    if (!handle) {
+        fprintf(stderr, "%s\n", dlerror());
+        return NULL;
+    }
+    api->allocator_create = dlsym(handle, "allocator_create");
+    api->allocator_destroy = dlsym(handle, "allocator_destroy");
+    api->allocator_alloc = dlsym(handle, "allocator_alloc");
+    api->allocator_free = dlsym(handle, "allocator_free");
+    if (!api->allocator_create || !api->allocator_destroy || !api->allocator_alloc || !api->allocator_free) {
+        fprintf(stderr, "%s\n", dlerror());
+        dlclose(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+static inline double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline int compare_floats(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+static inline void sort_latencies(float *latencies, long count) {
+    qsort(latencies, count, sizeof(float), compare_floats);
+}
+
+// The latency at per_mille thousandths of count sorted latencies; 1000 gives
+// the largest, and no latencies give 0.
+static inline float latency_at(const float *sorted, long count, int per_mille) {
+    if (count == 0) {
+        return 0;
+    }
+    long i = count * per_mille / 1000;
+    return sorted[i < count ? i : count - 1];
+}
+
+#endif
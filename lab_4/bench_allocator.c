@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bench.h"
+
+// Allocation latency under fragmentation.
+//
+// The arena is filled with chunk-sized allocations until one fails, which
+// shows whether allocation slows down as the arena fills up, then a
+// growing random share of the chunks is freed: 0%, 10%, 50% and 90%. At each
+// level single allocations of 1 and 8 chunks are timed, each freed again
+// right away so the level stays as it is. Latencies go into power-of-two
+// nanosecond buckets. Failed requests are timed too (they are the full
+// searches); the library's error messages are silenced while timing.
+// allocator_1 reads its placement policy from ALLOCATOR_POLICY.
+//
+// Usage: ./bench_allocator <library.so> [arena_kb] [chunk] [samples] [seed]
+
+#define BUCKETS 32
+
+// Times samples allocations of size bytes and prints their distribution.
+static void measure(const AllocatorAPI *api, void *allocator, const char *level, size_t size,
+                    int samples, float *latencies) {
+    long histogram[BUCKETS] = {0};
+    int failed = 0;
+    double total = 0;
+
+    for (int s = 0; s < samples; s++) {
+        double t0 = now_ns();
+        void *ptr = api->allocator_alloc(allocator, size);
+        double ns = now_ns() - t0;
+        if (ptr != NULL) {
+            api->allocator_free(allocator, ptr, size);
+        } else {
+            failed++;
+        }
+        latencies[s] = ns;
+        total += ns;
+        int bucket = 0;
+        while (bucket < BUCKETS - 1 && ns >= (double)(2L << bucket)) {
+            bucket++;
+        }
+        histogram[bucket]++;
+    }
+
+    sort_latencies(latencies, samples);
+    printf("%-4s freed, %7zu B: mean %9.0f ns, p50 %9.0f, p99 %9.0f, max %9.0f, failed %d/%d\n",
+           level, size, total / samples, latency_at(latencies, samples, 500),
+           latency_at(latencies, samples, 990), latency_at(latencies, samples, 1000), failed, samples);
+    printf("    ");
+    for (int b = 0; b < BUCKETS; b++) {
+        if (histogram[b] > 0) {
+            printf(" <%ld:%ld", 2L << b, histogram[b]);
+        }
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <library.so> [arena_kb] [chunk] [samples] [seed]\n", argv[0]);
+        return 1;
+    }
+    size_t arena = (argc > 2 ? strtoul(argv[2], NULL, 10) : 4096) * 1024;
+    size_t chunk = argc > 3 ? strtoul(argv[3], NULL, 10) : 256;
+    int samples = argc > 4 ? atoi(argv[4]) : 2000;
+    unsigned int seed = argc > 5 ? strtoul(argv[5], NULL, 10) : 1;
+    if (arena == 0 || chunk == 0 || samples < 1) {
+        fprintf(stderr, "arena, chunk and samples must be >= 1\n");
+        return 1;
+    }
+
+    AllocatorAPI api;
+    void *handle = bench_load(argv[1], &api);
+    if (handle == NULL) {
+        return 1;
+    }
+
+    void *allocator = api.allocator_create(NULL, arena);
+    if (allocator == NULL) {
+        return 1;
+    }
+
+    int saved_stderr = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDERR_FILENO);
+
+    size_t capacity = arena / chunk + 1;
+    void **chunks = malloc(capacity * sizeof(void *));
+    float *latencies = malloc(samples * sizeof(float));
+    float *fill_ns = malloc(capacity * sizeof(float));
+    size_t count = 0;
+    double fill_total = 0;
+    for (; count < capacity; count++) {
+        double t0 = now_ns();
+        chunks[count] = api.allocator_alloc(allocator, chunk);
+        double ns = now_ns() - t0;
+        fill_ns[count] = ns;
+        fill_total += ns;
+        if (chunks[count] == NULL) {
+            break;
+        }
+    }
+
+    dup2(saved_stderr, STDERR_FILENO);
+    printf("%s: %zu KB arena, %zu B chunks, %zu chunks filled in %.1f ms, %d samples\n",
+           argv[1], arena / 1024, chunk, count, fill_total / 1e6, samples);
+    printf("fill, p50 per allocation by quarter:");
+    for (int q = 0; q < 4; q++) {
+        size_t from = count * q / 4, to = count * (q + 1) / 4;
+        sort_latencies(fill_ns + from, to - from);
+        printf(" %.0f", latency_at(fill_ns + from, to - from, 500));
+    }
+    printf(" ns\n");
+    free(fill_ns);
+
+    // Random order in which chunks get freed.
+    srand(seed);
+    for (size_t i = count; i > 1; i--) {
+        size_t j = rand() % i;
+        void *tmp = chunks[i - 1];
+        chunks[i - 1] = chunks[j];
+        chunks[j] = tmp;
+    }
+
+    static const int levels[] = {0, 10, 50, 90};
+    size_t freed = 0;
+    for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+        size_t target = count * levels[l] / 100;
+        for (; freed < target; freed++) {
+            api.allocator_free(allocator, chunks[freed], chunk);
+        }
+        char level[8];
+        snprintf(level, sizeof(level), "%d%%", levels[l]);
+
+        dup2(null_fd, STDERR_FILENO);
+        measure(&api, allocator, level, chunk, samples, latencies);
+        measure(&api, allocator, level, 8 * chunk, samples, latencies);
+        dup2(saved_stderr, STDERR_FILENO);
+        fflush(stdout);
+    }
+
+    close(null_fd);
+    close(saved_stderr);
+    free(chunks);
+    free(latencies);
+    api.allocator_destroy(allocator);
+    dlclose(handle);
+    return 0;
+}
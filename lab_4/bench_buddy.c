@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bench.h"
+
+// Mixed-size alloc/free churn, meant for allocator_2.
+//
+// For each live-set size a table of that many blocks is filled with random
+// sizes, log-uniform from 16 B to 4 KB, then for ops rounds a random block
+// is freed and replaced by one of a new random size. Every free and alloc is
+// timed on its own. If free cost does not depend on how many blocks are free
+// or how often buddies merge, the free latency stays the same as the live
+// set, and with it the number of free blocks, grows by 100x. Each live set
+// also reports how much address space the allocator mapped and how much of
+// it is resident once the churn is done, both from /proc/self/statm.
+//
+// Usage: ./bench_buddy <library.so> [arena_kb] [ops] [seed] [live...]
+
+// Virtual and resident size of the process in MB.
+static void read_statm(double *virtual_mb, double *resident_mb) {
+    long pages_virtual = 0, pages_resident = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file != NULL) {
+        if (fscanf(file, "%ld %ld", &pages_virtual, &pages_resident) != 2) {
+            pages_virtual = pages_resident = 0;
+        }
+        fclose(file);
+    }
+    double page_mb = sysconf(_SC_PAGESIZE) / 1048576.0;
+    *virtual_mb = pages_virtual * page_mb;
+    *resident_mb = pages_resident * page_mb;
+}
+
+// 16 B to 4 KB, evenly spread over the powers of two in between.
+static size_t random_size(void) {
+    int shift = 4 + rand() % 8;
+    return ((size_t)1 << shift) + rand() % ((size_t)1 << shift);
+}
+
+static void print_latencies(const char *name, float *latencies, long count) {
+    double total = 0;
+    for (long i = 0; i < count; i++) {
+        total += latencies[i];
+    }
+    sort_latencies(latencies, count);
+    printf("  %-5s mean %7.0f ns, p50 %7.0f, p99 %7.0f, p99.9 %7.0f, max %9.0f\n", name,
+           count > 0 ? total / count : 0, latency_at(latencies, count, 500),
+           latency_at(latencies, count, 990), latency_at(latencies, count, 999),
+           latency_at(latencies, count, 1000));
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <library.so> [arena_kb] [ops] [seed] [live...]\n", argv[0]);
+        return 1;
+    }
+    size_t arena = (argc > 2 ? strtoul(argv[2], NULL, 10) : 262144) * 1024;
+    long ops = argc > 3 ? atol(argv[3]) : 2000000;
+    unsigned int seed = argc > 4 ? strtoul(argv[4], NULL, 10) : 1;
+    long default_live[] = {1000, 10000, 100000};
+    long *live_counts = argc > 5 ? malloc((argc - 5) * sizeof(long)) : default_live;
+    int num_live = argc > 5 ? argc - 5 : 3;
+    long max_live = 0;
+    for (int l = 0; l < num_live; l++) {
+        if (argc > 5) {
+            live_counts[l] = atol(argv[5 + l]);
+        }
+        if (live_counts[l] < 1) {
+            fprintf(stderr, "live counts must be >= 1\n");
+            return 1;
+        }
+        if (live_counts[l] > max_live) {
+            max_live = live_counts[l];
+        }
+    }
+    if (arena == 0 || ops < 1) {
+        fprintf(stderr, "arena and ops must be >= 1\n");
+        return 1;
+    }
+
+    AllocatorAPI api;
+    void *handle = bench_load(argv[1], &api);
+    if (handle == NULL) {
+        return 1;
+    }
+
+    void **blocks = malloc(max_live * sizeof(void *));
+    size_t *sizes = malloc(max_live * sizeof(size_t));
+    float *alloc_ns = malloc(ops * sizeof(float));
+    float *free_ns = malloc(ops * sizeof(float));
+
+    // Failed requests print errors; keep them off the report.
+    int saved_stderr = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    printf("%s: %zu KB arena, %ld ops per live-set size, 16 B - 4 KB requests\n", argv[1],
+           arena / 1024, ops);
+    for (int l = 0; l < num_live; l++) {
+        long live = live_counts[l];
+        double virtual_before, resident_before, virtual_after, resident_after;
+        read_statm(&virtual_before, &resident_before);
+        void *allocator = api.allocator_create(NULL, arena);
+        if (allocator == NULL) {
+            return 1;
+        }
+        srand(seed);
+        dup2(null_fd, STDERR_FILENO);
+
+        long failed = 0;
+        for (long i = 0; i < live; i++) {
+            sizes[i] = random_size();
+            blocks[i] = api.allocator_alloc(allocator, sizes[i]);
+            failed += blocks[i] == NULL;
+        }
+
+        long frees = 0;
+        double t0 = now_ns();
+        for (long op = 0; op < ops; op++) {
+            long i = rand() % live;
+            if (blocks[i] != NULL) {
+                double start = now_ns();
+                api.allocator_free(allocator, blocks[i], sizes[i]);
+                free_ns[frees++] = now_ns() - start;
+            }
+            sizes[i] = random_size();
+            double start = now_ns();
+            blocks[i] = api.allocator_alloc(allocator, sizes[i]);
+            alloc_ns[op] = now_ns() - start;
+            failed += blocks[i] == NULL;
+        }
+        double seconds = (now_ns() - t0) / 1e9;
+
+        for (long i = 0; i < live; i++) {
+            if (blocks[i] != NULL) {
+                api.allocator_free(allocator, blocks[i], sizes[i]);
+            }
+        }
+        dup2(saved_stderr, STDERR_FILENO);
+        read_statm(&virtual_after, &resident_after);
+        api.allocator_destroy(allocator);
+
+        printf("live %ld: %.2f s, %ld failed allocations, %.1f MB mapped, %.1f MB resident\n", live,
+               seconds, failed, virtual_after - virtual_before, resident_after - resident_before);
+        print_latencies("free", free_ns, frees);
+        print_latencies("alloc", alloc_ns, ops);
+        fflush(stdout);
+    }
+
+    close(null_fd);
+    close(saved_stderr);
+    free(blocks);
+    free(sizes);
+    free(alloc_ns);
+    free(free_ns);
+    if (live_counts != default_live) {
+        free(live_counts);
+    }
+    dlclose(handle);
+    return 0;
+}
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "bench.h"
+
+// Multithreaded alloc/free throughput, from 1 thread up to max_threads in
+// powers of two.
+//
+// Every thread keeps 256 blocks of its own and for ops rounds replaces a
+// random one with a new block of 16 B to 1 KB. Each block is stamped with
+// its owner and slot in the first and last byte and checked before it is
+// freed, so blocks handed out twice show up as corrupted. Two modes run on
+// one allocator per thread count:
+//   lock      the library as built, every call under one mutex in here
+//   magazine  ALLOCATOR_THREAD_SAFE=1, the library's own per-thread caches
+//
+// Usage: ./bench_threads <library.so> [arena_kb] [ops] [max_threads]
+
+#define SLOTS 256
+
+typedef struct {
+    const AllocatorAPI *api;
+    void *allocator;
+    pthread_mutex_t *lock;
+    pthread_barrier_t *start;
+    long ops;
+    int id;
+    long failed;
+    long corrupted;
+    // When this worker started and finished its rounds.
+    double started;
+    double finished;
+} Worker;
+
+static void *run_worker(void *arg) {
+    Worker *worker = arg;
+    const AllocatorAPI *api = worker->api;
+    unsigned char *blocks[SLOTS] = {0};
+    size_t sizes[SLOTS];
+    unsigned int seed = worker->id + 1;
+
+    pthread_barrier_wait(worker->start);
+    worker->started = now_ns();
+    for (long op = 0; op < worker->ops + SLOTS; op++) {
+        // The last SLOTS rounds free everything that is left.
+        int slot = op < worker->ops ? rand_r(&seed) % SLOTS : op - worker->ops;
+        unsigned char stamp = worker->id * 31 + slot;
+        if (blocks[slot] != NULL) {
+            if (blocks[slot][0] != stamp || blocks[slot][sizes[slot] - 1] != stamp) {
+                worker->corrupted++;
+            }
+            if (worker->lock) {
+                pthread_mutex_lock(worker->lock);
+            }
+            api->allocator_free(worker->allocator, blocks[slot], sizes[slot]);
+            if (worker->lock) {
+                pthread_mutex_unlock(worker->lock);
+            }
+            blocks[slot] = NULL;
+        }
+        if (op >= worker->ops) {
+            continue;
+        }
+
+        int shift = 4 + rand_r(&seed) % 6;
+        sizes[slot] = ((size_t)1 << shift) + rand_r(&seed) % ((size_t)1 << shift);
+        if (worker->lock) {
+            pthread_mutex_lock(worker->lock);
+        }
+        blocks[slot] = api->allocator_alloc(worker->allocator, sizes[slot]);
+        if (worker->lock) {
+            pthread_mutex_unlock(worker->lock);
+        }
+        if (blocks[slot] == NULL) {
+            worker->failed++;
+            continue;
+        }
+        blocks[slot][0] = stamp;
+        blocks[slot][sizes[slot] - 1] = stamp;
+    }
+    worker->finished = now_ns();
+    return NULL;
+}
+
+// Millions of alloc/free pairs per second, or -1 if something failed.
+static double run(const AllocatorAPI *api, size_t arena, long ops, int threads, int use_lock) {
+    void *allocator = api->allocator_create(NULL, arena);
+    if (allocator == NULL) {
+        return -1;
+    }
+    pthread_mutex_t lock;
+    pthread_mutex_init(&lock, NULL);
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, threads + 1);
+
+    Worker *workers = calloc(threads, sizeof(Worker));
+    pthread_t *ids = malloc(threads * sizeof(pthread_t));
+    for (int t = 0; t < threads; t++) {
+        workers[t].api = api;
+        workers[t].allocator = allocator;
+        workers[t].lock = use_lock ? &lock : NULL;
+        workers[t].start = &start;
+        workers[t].ops = ops;
+        workers[t].id = t;
+        pthread_create(&ids[t], NULL, run_worker, &workers[t]);
+    }
+    pthread_barrier_wait(&start);
+    long failed = 0, corrupted = 0;
+    // From the first worker starting to the last one finishing.
+    double first_start = 0, last_finish = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(ids[t], NULL);
+        failed += workers[t].failed;
+        corrupted += workers[t].corrupted;
+        if (t == 0 || workers[t].started < first_start) {
+            first_start = workers[t].started;
+        }
+        if (workers[t].finished > last_finish) {
+            last_finish = workers[t].finished;
+        }
+    }
+    double seconds = (last_finish - first_start) / 1e9;
+
+    api->allocator_destroy(allocator);
+    pthread_barrier_destroy(&start);
+    pthread_mutex_destroy(&lock);
+    free(workers);
+    free(ids);
+    if (failed > 0 || corrupted > 0) {
+        fprintf(stderr, "%d threads, %s: %ld failed, %ld corrupted\n", threads,
+                use_lock ? "lock" : "magazine", failed, corrupted);
+        return -1;
+    }
+    return threads * ops / seconds / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <library.so> [arena_kb] [ops] [max_threads]\n", argv[0]);
+        return 1;
+    }
+    size_t arena = (argc > 2 ? strtoul(argv[2], NULL, 10) : 65536) * 1024;
+    long ops = argc > 3 ? atol(argv[3]) : 1000000;
+    int max_threads = argc > 4 ? atoi(argv[4]) : 32;
+    if (arena == 0 || ops < 1 || max_threads < 1) {
+        fprintf(stderr, "arena, ops and max_threads must be >= 1\n");
+        return 1;
+    }
+
+    AllocatorAPI api;
+    void *handle = bench_load(argv[1], &api);
+    if (handle == NULL) {
+        return 1;
+    }
+
+    printf("%s: %zu KB arena, %ld ops per thread, 16 B - 1 KB requests\n", argv[1], arena / 1024, ops);
+    printf("%8s %12s %16s %8s\n", "threads", "lock Mops/s", "magazine Mops/s", "ratio");
+    int failed = 0;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        unsetenv("ALLOCATOR_THREAD_SAFE");
+        double locked = run(&api, arena, ops, threads, 1);
+        setenv("ALLOCATOR_THREAD_SAFE", "1", 1);
+        double cached = run(&api, arena, ops, threads, 0);
+        failed |= locked < 0 || cached < 0;
+        printf("%8d %12.2f %16.2f %7.1fx\n", threads, locked, cached, cached / locked);
+        fflush(stdout);
+    }
+
+    dlclose(handle);
+    return failed;
+}
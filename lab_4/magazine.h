@@ -0,0 +1,280 @@
+#ifndef LAB_4_MAGAZINE_H
+#define LAB_4_MAGAZINE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+// Per-thread caches of free blocks ("magazines") in front of an allocator
+// that is not thread-safe itself, the central allocator.
+//
+// Requests up to the largest size class are rounded up to a power of two,
+// class c holding blocks of 1 << (class_shift + c) bytes, and served from
+// the calling thread's magazine for the class without touching the shared
+// lock. An
+// empty magazine is refilled with MAGAZINE_BATCH blocks from the central
+// allocator under one lock, and a full one hands its MAGAZINE_BATCH oldest
+// blocks back the same way. Larger requests, and frees of them, go to the
+// central allocator directly under the lock. When the central allocator runs
+// out, every thread's magazines are handed back and the request is tried once
+// more, so a block cached by an idle thread never makes a request fail.
+// Refills ask the central allocator with report == 0, so running out of
+// room partway through a batch prints nothing.
+//
+// Each cache has a lock of its own, a flag its thread sets around every fast
+// path call; it is only contended while another thread reclaims the cache.
+// Anything that also needs the depot lock takes that one first, so a thread
+// can lock another thread's cache while it holds the depot lock.
+//
+// What stays different from calling the central allocator directly is the
+// rounding: a cached request takes a whole class-sized block, so a set of
+// live blocks that just fits the arena unrounded may not fit in this mode.
+//
+// The central allocator only ever sees class-sized requests for cached
+// classes, so a cached block can be handed back with its class size no
+// matter which size the caller freed it with. A block freed in another
+// thread than the one that allocated it just joins that thread's magazine.
+// Frees that hit a magazine are not checked; errors show up when the block
+// goes back to the central allocator.
+
+#define MAGAZINE_CLASSES 8
+#define MAGAZINE_ROUNDS 64
+#define MAGAZINE_BATCH 32
+
+struct MagazineDepot;
+
+typedef struct MagazineCache {
+    struct MagazineCache *next;
+    struct MagazineCache *prev;
+    struct MagazineDepot *depot;
+    atomic_flag lock;
+    int count[MAGAZINE_CLASSES];
+    void *blocks[MAGAZINE_CLASSES][MAGAZINE_ROUNDS];
+} MagazineCache;
+
+typedef struct MagazineDepot {
+    pthread_mutex_t lock;
+    // Each thread's MagazineCache; a thread's cache is handed back when it
+    // exits.
+    pthread_key_t key;
+    // Every live cache, so destroy can unmap them and a failed request can
+    // empty them.
+    MagazineCache *caches;
+    void *owner;
+    int class_shift;
+    // Prints an error on failure only if report is set.
+    void *(*central_alloc)(void *owner, size_t size, int report);
+    void (*central_free)(void *owner, void *memory, size_t size);
+} MagazineDepot;
+
+static inline void magazine_lock(MagazineCache *cache) {
+    while (atomic_flag_test_and_set_explicit(&cache->lock, memory_order_acquire)) {
+        sched_yield();
+    }
+}
+
+static inline void magazine_unlock(MagazineCache *cache) {
+    atomic_flag_clear_explicit(&cache->lock, memory_order_release);
+}
+
+static inline int magazine_class(const MagazineDepot *depot, size_t size) {
+    size_t below = (size - 1) >> depot->class_shift;
+    return below == 0 ? 0 : 64 - __builtin_clzll(below);
+}
+
+static inline size_t magazine_class_size(const MagazineDepot *depot, int class) {
+    return (size_t)1 << (depot->class_shift + class);
+}
+
+// What the central allocator is asked for when a request of a cached class
+// has to skip the magazines, because the thread's cache could not be made:
+// the class size, so the block can later be freed through a magazine, and a
+// magazine block freed here, with the size both sides agree on.
+static inline size_t magazine_central_size(const MagazineDepot *depot, int class, size_t size) {
+    return class < MAGAZINE_CLASSES ? magazine_class_size(depot, class) : size;
+}
+
+// Hands the count oldest blocks of a class back; the depot lock must be held
+// and the cache locked, unless its thread is exiting.
+static inline void magazine_flush(MagazineDepot *depot, MagazineCache *cache, int class, int count) {
+    size_t size = magazine_class_size(depot, class);
+    for (int i = 0; i < count; i++) {
+        depot->central_free(depot->owner, cache->blocks[class][i], size);
+    }
+    cache->count[class] -= count;
+    memmove(cache->blocks[class], cache->blocks[class] + count, cache->count[class] * sizeof(void *));
+}
+
+static inline void magazine_flush_all(MagazineDepot *depot, MagazineCache *cache) {
+    for (int class = 0; class < MAGAZINE_CLASSES; class++) {
+        magazine_flush(depot, cache, class, cache->count[class]);
+    }
+}
+
+// Hands every thread's cached blocks back; the depot lock must be held, and
+// held_cache is a cache the caller has locked already, or NULL.
+static inline void magazine_reclaim(MagazineDepot *depot, MagazineCache *held_cache) {
+    for (MagazineCache *cache = depot->caches; cache != NULL; cache = cache->next) {
+        if (cache != held_cache) {
+            magazine_lock(cache);
+        }
+        magazine_flush_all(depot, cache);
+        if (cache != held_cache) {
+            magazine_unlock(cache);
+        }
+    }
+}
+
+static inline void magazine_thread_exit(void *data) {
+    MagazineCache *cache = data;
+    MagazineDepot *depot = cache->depot;
+
+    pthread_mutex_lock(&depot->lock);
+    magazine_flush_all(depot, cache);
+    if (cache->prev != NULL) {
+        cache->prev->next = cache->next;
+    } else {
+        depot->caches = cache->next;
+    }
+    if (cache->next != NULL) {
+        cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&depot->lock);
+
+    munmap(cache, sizeof(MagazineCache));
+}
+
+// Returns 0, or -1 if the lock or the thread key cannot be set up.
+static inline int magazine_init(MagazineDepot *depot, void *owner, int class_shift,
+                                void *(*central_alloc)(void *owner, size_t size, int report),
+                                void (*central_free)(void *owner, void *memory, size_t size)) {
+    if (pthread_mutex_init(&depot->lock, NULL) != 0) {
+        return -1;
+    }
+    if (pthread_key_create(&depot->key, magazine_thread_exit) != 0) {
+        pthread_mutex_destroy(&depot->lock);
+        return -1;
+    }
+    depot->caches = NULL;
+    depot->owner = owner;
+    depot->class_shift = class_shift;
+    depot->central_alloc = central_alloc;
+    depot->central_free = central_free;
+    return 0;
+}
+
+// Drops every thread's cache without handing the blocks back, since the
+// central allocator goes away too.
+static inline void magazine_destroy(MagazineDepot *depot) {
+    pthread_key_delete(depot->key);
+    while (depot->caches != NULL) {
+        MagazineCache *next = depot->caches->next;
+        munmap(depot->caches, sizeof(MagazineCache));
+        depot->caches = next;
+    }
+    pthread_mutex_destroy(&depot->lock);
+}
+
+// The calling thread's cache, made on first use; NULL if out of memory.
+static inline MagazineCache *magazine_cache(MagazineDepot *depot) {
+    MagazineCache *cache = pthread_getspecific(depot->key);
+    if (cache != NULL) {
+        return cache;
+    }
+
+    cache = mmap(NULL, sizeof(MagazineCache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED) {
+        perror("Error mmap for thread cache");
+        return NULL;
+    }
+    cache->depot = depot;
+    atomic_flag_clear(&cache->lock);
+    pthread_mutex_lock(&depot->lock);
+    cache->next = depot->caches;
+    if (cache->next != NULL) {
+        cache->next->prev = cache;
+    }
+    depot->caches = cache;
+    pthread_mutex_unlock(&depot->lock);
+    pthread_setspecific(depot->key, cache);
+    return cache;
+}
+
+static inline void *magazine_alloc(MagazineDepot *depot, size_t size) {
+    int class = magazine_class(depot, size);
+    MagazineCache *cache = class < MAGAZINE_CLASSES ? magazine_cache(depot) : NULL;
+    if (cache == NULL) {
+        size = magazine_central_size(depot, class, size);
+        pthread_mutex_lock(&depot->lock);
+        void *memory = depot->central_alloc(depot->owner, size, depot->caches == NULL);
+        if (memory == NULL && depot->caches != NULL) {
+            magazine_reclaim(depot, NULL);
+            memory = depot->central_alloc(depot->owner, size, 1);
+        }
+        pthread_mutex_unlock(&depot->lock);
+        return memory;
+    }
+
+    magazine_lock(cache);
+    if (cache->count[class] > 0) {
+        void *memory = cache->blocks[class][--cache->count[class]];
+        magazine_unlock(cache);
+        return memory;
+    }
+    // Refill with the depot lock taken first, see above. Other threads can
+    // only take blocks out of this cache in between, so it is still empty.
+    magazine_unlock(cache);
+    size_t class_size = magazine_class_size(depot, class);
+    pthread_mutex_lock(&depot->lock);
+    magazine_lock(cache);
+    while (cache->count[class] < MAGAZINE_BATCH) {
+        void *block = depot->central_alloc(depot->owner, class_size, 0);
+        if (block == NULL) {
+            break;
+        }
+        cache->blocks[class][cache->count[class]++] = block;
+    }
+    if (cache->count[class] == 0) {
+        // What is missing may be sitting in any thread's magazines.
+        magazine_reclaim(depot, cache);
+        void *block = depot->central_alloc(depot->owner, class_size, 1);
+        if (block != NULL) {
+            cache->blocks[class][cache->count[class]++] = block;
+        }
+    }
+    pthread_mutex_unlock(&depot->lock);
+    void *memory = cache->count[class] > 0 ? cache->blocks[class][--cache->count[class]] : NULL;
+    magazine_unlock(cache);
+    return memory;
+}
+
+static inline void magazine_free(MagazineDepot *depot, void *memory, size_t size) {
+    int class = magazine_class(depot, size);
+    MagazineCache *cache = class < MAGAZINE_CLASSES ? magazine_cache(depot) : NULL;
+    if (cache == NULL) {
+        size = magazine_central_size(depot, class, size);
+        pthread_mutex_lock(&depot->lock);
+        depot->central_free(depot->owner, memory, size);
+        pthread_mutex_unlock(&depot->lock);
+        return;
+    }
+
+    magazine_lock(cache);
+    if (cache->count[class] == MAGAZINE_ROUNDS) {
+        magazine_unlock(cache);
+        pthread_mutex_lock(&depot->lock);
+        magazine_lock(cache);
+        // Another thread may have emptied it in between.
+        if (cache->count[class] == MAGAZINE_ROUNDS) {
+            magazine_flush(depot, cache, class, MAGAZINE_BATCH);
+        }
+        pthread_mutex_unlock(&depot->lock);
+    }
+    cache->blocks[class][cache->count[class]++] = memory;
+    magazine_unlock(cache);
+}
+
+#endif